@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -6,6 +7,24 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+__attribute__((format(printf,1,2)))
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
 
 __attribute__((format(printf,1,2)))
 static void warning(const char *fmt, ...)
@@ -17,20 +36,797 @@ static void warning(const char *fmt, ...)
     va_end(ap);
 }
 
-int main(void)
+static void show_usage(void)
+{
+    static const char *text[] = {
+        "usage: add [options] [file...]",
+        "",
+        "Adds the numbers in the files, or on stdin, one per line.",
+        "Numbers are read like strtoll() with base 0 does, so 0x10 is 16",
+        "and 010 is 8. Values and sums are exact up to 128 bits, so the",
+        "sum of 64 bit values doesn't overflow.",
+        "",
+        "options",
+        "-f n Use field n of each line, counting from 1. The default is the",
+        "   whole line, or field 1 with -d or -k.",
+        "-d c Fields are separated by the character c. The default is runs",
+        "   of spaces and tabs.",
+        "-k n Group lines by field n, and print a line per key, sorted by key.",
+        "-a list Print these aggregates, separated by commas: count, sum, min,",
+        "   max, mean and stddev (the population standard deviation). The",
+        "   default is sum. Values are separated by tabs.",
+        "-j threads Add regular files with this many threads. The default is",
+        "   the number of CPUs.",
+        "",
+    };
+
+    size_t i, n = sizeof text / sizeof *text;
+    for (i = 0; i < n; i++)
+        puts(text[i]);
+}
+
+static long g_nthreads = 0;
+static int g_field = 0;     // 0 is the whole line
+static int g_keyfield = 0;  // 0 means no grouping
+static char g_delim = '\0'; // \0 means runs of white space
+
+// Values and sums are 128 bits, so a sum can't overflow for any input
+// we'll see, and we report sums which don't fit in a long long instead
+// of wrapping.
+__extension__ typedef __int128 sum_t;
+__extension__ typedef unsigned __int128 usum_t;
+
+// Most lines are plain decimal numbers, and we parse those ourselves,
+// eight digits at a time when we can. Anything else, like hex, octal,
+// numbers with 19 digits or more, and trailing garbage, goes to
+// strtoll(), so we accept what we always did. Numbers too big for
+// strtoll() are parsed again into a sum_t.
+#define MAX_FAST_DIGITS 18 // Fits in a long long, whatever the digits are
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Are all eight bytes digits? A byte below '0' borrows and one above '9'
+// carries into its high bit. A carry or borrow into the next byte only
+// happens when this byte fails anyway.
+static inline bool eight_digits(const char *p)
+{
+    uint64_t x;
+
+    memcpy(&x, p, sizeof x);
+    return (((x + 0x4646464646464646ULL) | (x - 0x3030303030303030ULL)) & 0x8080808080808080ULL) == 0;
+}
+
+// Eight digits to a number, with the first digit in the lowest byte.
+// Each step merges pairs of neighbours, so we need three multiplies.
+static inline uint64_t parse_eight(const char *p)
+{
+    uint64_t x;
+
+    memcpy(&x, p, sizeof x);
+    x = (x & 0x0F0F0F0F0F0F0F0FULL) * 2561 >> 8;
+    x = (x & 0x00FF00FF00FF00FFULL) * 6553601 >> 16;
+    return (x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL >> 32;
+}
+#endif
+
+// Parse a plain decimal number, with optional white space and sign.
+// Returns false if the line needs strtoll().
+static bool parse_fast(const char *p, const char *end, sum_t *value)
+{
+    uint64_t v = 0;
+    int ndigits = 0;
+    bool neg = false;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+
+    // Leading zeros mean octal or hex.
+    if (p == end || !isdigit((unsigned char)*p) || (*p == '0' && end - p > 1 && !isspace((unsigned char)p[1])))
+        return false;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (end - p >= 8 && ndigits + 8 <= MAX_FAST_DIGITS && eight_digits(p)) {
+        v = v * 100000000 + parse_eight(p);
+        ndigits += 8;
+        p += 8;
+    }
+#endif
+
+    while (p < end && isdigit((unsigned char)*p)) {
+        if (++ndigits > MAX_FAST_DIGITS)
+            return false;
+
+        v = v * 10 + (*p++ - '0');
+    }
+
+    while (p < end && isspace((unsigned char)*p))
+        p++;
+
+    if (p != end)
+        return false;
+
+    *value = neg ? -(long long)v : (long long)v;
+    return true;
+}
+
+// Same syntax as strtoll() with base 0, but into a sum_t. Returns false
+// if the value doesn't fit.
+static bool parse_wide(const char *s, sum_t *value)
+{
+    usum_t u = 0, limit;
+    unsigned base = 10, d;
+    bool neg = false;
+
+    while (isspace((unsigned char)*s))
+        s++;
+
+    if (*s == '-' || *s == '+')
+        neg = *s++ == '-';
+
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X') && isxdigit((unsigned char)s[2])) {
+        base = 16;
+        s += 2;
+    }
+    else if (s[0] == '0')
+        base = 8;
+
+    limit = neg ? (usum_t)1 << 127 : ((usum_t)1 << 127) - 1;
+    for (; isxdigit((unsigned char)*s); s++) {
+        d = isdigit((unsigned char)*s) ? *s - '0' : tolower((unsigned char)*s) - 'a' + 10;
+        if (d >= base)
+            break;
+
+        if (u > (limit - d) / base)
+            return false;
+
+        u = u * base + d;
+    }
+
+    *value = neg ? (sum_t)-u : (sum_t)u;
+    return true;
+}
+
+static bool parse_slow(const char *line, const char *end, sum_t *value)
+{
+    char buf[1024], *endp;
+    size_t n = end - line;
+    long long i;
+
+    if (n >= sizeof buf)
+        n = sizeof buf - 1;
+
+    memcpy(buf, line, n);
+    buf[n] = '\0';
+
+    errno = 0;
+    i = strtoll(buf, &endp, 0);
+    if (endp == buf)
+        warning("Could not interpret %s\n", buf);
+    else if (errno != ERANGE) {
+        *value = i;
+        return true;
+    }
+    else if (parse_wide(buf, value))
+        return true;
+    else
+        warning("%s: Out of range\n", buf);
+
+    return false;
+}
+
+// We aggregate everything in one pass. Each aggregate is kept for all
+// lines, or with -k, for each key. The standard deviation is computed
+// with Welford's method, which doesn't lose precision like summing
+// squares does. Two sets of aggregates can be merged, so each thread
+// has its own, and we merge them at the end.
+enum aggregate { AGG_COUNT, AGG_SUM, AGG_MIN, AGG_MAX, AGG_MEAN, AGG_STDDEV };
+
+static const char *aggnames[] = { "count", "sum", "min", "max", "mean", "stddev" };
+
+static enum aggregate g_aggs[16] = { AGG_SUM };
+static size_t g_naggs = 1;
+static bool g_welford = false; // Do we need the variance?
+
+struct stats {
+    unsigned long long count;
+    sum_t sum;
+    sum_t min, max;
+    double mean, m2;
+};
+
+// Groups are kept in an open addressing hash table with linear
+// probing. Keys are stored once, with a NUL, in an arena. Offset 0 means
+// the slot is empty, so the arena starts with a dummy byte.
+struct group {
+    uint32_t hash;
+    uint32_t keylen;
+    size_t key;
+    struct stats st;
+};
+
+struct acc {
+    struct stats total;
+    struct group *groups;
+    size_t ngroups, nslots; // nslots is a power of two
+    char *keys;
+    size_t keys_used, keys_size;
+};
+
+static void update(struct stats *st, sum_t v)
+{
+    double delta;
+
+    if (st->count == 0 || v < st->min)
+        st->min = v;
+    if (st->count == 0 || v > st->max)
+        st->max = v;
+
+    st->count++;
+    st->sum += v;
+    if (g_welford) {
+        delta = v - st->mean;
+        st->mean += delta / st->count;
+        st->m2 += delta * (v - st->mean);
+    }
+}
+
+static void merge_stats(struct stats *dst, const struct stats *src)
+{
+    double delta, n;
+
+    if (src->count == 0)
+        return;
+
+    if (dst->count == 0) {
+        *dst = *src;
+        return;
+    }
+
+    n = (double)dst->count + src->count;
+    delta = src->mean - dst->mean;
+    dst->m2 += src->m2 + delta * delta * dst->count * src->count / n;
+    dst->mean += delta * src->count / n;
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+// FNV-1a
+static uint32_t hash_key(const char *s, size_t n)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (n-- > 0) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h ^ (h >> 32);
+}
+
+static struct group *find_group(struct acc *a, const char *key, size_t len, uint32_t hash)
+{
+    size_t i = hash & (a->nslots - 1);
+    struct group *g;
+
+    for (;; i = (i + 1) & (a->nslots - 1)) {
+        g = &a->groups[i];
+        if (g->key == 0 || (g->hash == hash && g->keylen == len && memcmp(&a->keys[g->key], key, len) == 0))
+            return g;
+    }
+}
+
+static void grow_groups(struct acc *a)
+{
+    struct group *old = a->groups, *g;
+    size_t i, nold = a->nslots;
+
+    a->nslots = nold == 0 ? 1024 : nold * 2;
+    if ((a->groups = calloc(a->nslots, sizeof *a->groups)) == NULL)
+        die("Out of memory\n");
+
+    for (i = 0; i < nold; i++) {
+        if (old[i].key == 0)
+            continue;
+
+        for (g = &a->groups[old[i].hash & (a->nslots - 1)]; g->key != 0;
+            g = &a->groups[(g - a->groups + 1) & (a->nslots - 1)])
+            ;
+
+        *g = old[i];
+    }
+
+    free(old);
+}
+
+static size_t add_key(struct acc *a, const char *key, size_t len)
+{
+    size_t newsize, used;
+
+    // The dummy byte needs room too.
+    used = a->keys_used == 0 ? 1 : a->keys_used;
+    if (used + len + 1 > a->keys_size) {
+        newsize = a->keys_size == 0 ? 64 * 1024 : a->keys_size * 2;
+        while (newsize < used + len + 1)
+            newsize *= 2;
+
+        if ((a->keys = realloc(a->keys, newsize)) == NULL)
+            die("Out of memory\n");
+
+        a->keys_size = newsize;
+        if (a->keys_used == 0)
+            a->keys[a->keys_used++] = '\0';
+    }
+
+    memcpy(&a->keys[a->keys_used], key, len);
+    a->keys[a->keys_used + len] = '\0';
+    a->keys_used += len + 1;
+    return a->keys_used - len - 1;
+}
+
+static struct stats *group_stats(struct acc *a, const char *key, size_t len)
+{
+    uint32_t hash = hash_key(key, len);
+    struct group *g;
+
+    if ((a->ngroups + 1) * 4 > a->nslots * 3)
+        grow_groups(a);
+
+    g = find_group(a, key, len, hash);
+    if (g->key == 0) {
+        g->key = add_key(a, key, len);
+        g->hash = hash;
+        g->keylen = len;
+        a->ngroups++;
+    }
+
+    return &g->st;
+}
+
+static void merge_acc(struct acc *dst, struct acc *src)
+{
+    size_t i;
+
+    merge_stats(&dst->total, &src->total);
+    for (i = 0; i < src->nslots; i++) {
+        const struct group *g = &src->groups[i];
+
+        if (g->key != 0)
+            merge_stats(group_stats(dst, &src->keys[g->key], g->keylen), &g->st);
+    }
+
+    free(src->groups);
+    free(src->keys);
+}
+
+// Find field n, counting from 1, of the line from p to end. Returns
+// false if the line has fewer fields.
+static bool find_field(const char *p, const char *end, int n, const char **fb, const char **fe)
+{
+    const char *q;
+
+    if (n == 0) {
+        *fb = p;
+        *fe = end;
+        return true;
+    }
+
+    if (g_delim != '\0') {
+        for (; n > 1; n--) {
+            if ((q = memchr(p, g_delim, end - p)) == NULL)
+                return false;
+            p = q + 1;
+        }
+
+        *fb = p;
+        *fe = (q = memchr(p, g_delim, end - p)) == NULL ? end : q;
+        return true;
+    }
+
+    for (;;) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+
+        if (p == end)
+            return false;
+
+        for (q = p; q < end && *q != ' ' && *q != '\t' && *q != '\r'; q++)
+            ;
+
+        if (--n == 0) {
+            *fb = p;
+            *fe = q;
+            return true;
+        }
+
+        p = q;
+    }
+}
+
+// Add the lines from p to end. The last line needs no newline.
+static void add_lines(const char *p, const char *end, struct acc *a)
 {
-    char line[1024];
-    long long result = 0;
+    const char *eol, *q, *fb, *fe, *kb, *ke;
+    sum_t i;
 
-    while (fgets(line, sizeof line, stdin) != NULL) {
-        long long i = strtoll(line, NULL, 0);
-        if (i != 0)
-            result += i;
+    for (; p < end; p = eol + 1) {
+        if ((eol = memchr(p, '\n', end - p)) == NULL)
+            eol = end;
+
+        // Blank lines are just ignored.
+        for (q = p; q < eol && isspace((unsigned char)*q); q++)
+            ;
+
+        if (q == eol)
+            continue;
+
+        if (!find_field(p, eol, g_field, &fb, &fe)) {
+            warning("Missing field %d: %.*s\n", g_field, (int)(eol - p), p);
+            continue;
+        }
+
+        if (!parse_fast(fb, fe, &i) && !parse_slow(fb, fe, &i))
+            continue;
+
+        if (g_keyfield == 0)
+            update(&a->total, i);
+        else if (find_field(p, eol, g_keyfield, &kb, &ke))
+            update(group_stats(a, kb, ke - kb), i);
         else
-            warning("Could not interpret %s\n", line);
+            warning("Missing field %d: %.*s\n", g_keyfield, (int)(eol - p), p);
+    }
+}
+
+// Regular files are mapped, and cut in one chunk per thread. Chunks
+// start after a newline, so no line is split.
+struct chunk {
+    const char *begin, *end;
+    struct acc acc;
+    pthread_t tid;
+    bool started;
+};
+
+static void *add_chunk(void *arg)
+{
+    struct chunk *c = arg;
+
+    add_lines(c->begin, c->end, &c->acc);
+    return NULL;
+}
+
+static long nthreads(void)
+{
+    long n = g_nthreads;
+
+    if (n == 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+        n = 1;
+
+    return n;
+}
+
+static void add_mapped(const char *name, int fd, size_t size, struct acc *acc)
+{
+    struct chunk *chunks;
+    const char *map, *p, *end;
+    long i, n = nthreads();
+
+    if (size == 0)
+        return;
+
+    if ((map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        die("%s: %s\n", name, strerror(errno));
+
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    if ((size_t)n > size / (1024 * 1024) + 1)
+        n = size / (1024 * 1024) + 1;
+
+    if ((chunks = calloc(n, sizeof *chunks)) == NULL)
+        die("Out of memory\n");
+
+    end = map + size;
+    for (i = 0, p = map; i < n; i++) {
+        chunks[i].begin = p;
+        if (i == n - 1 || (p = map + size / n * (i + 1)) < chunks[i].begin
+        || (p = memchr(p, '\n', end - p)) == NULL)
+            p = end;
+        else
+            p++;
+
+        chunks[i].end = p;
+    }
+
+    // The first chunk is ours.
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&chunks[i].tid, NULL, add_chunk, &chunks[i]) == 0)
+            chunks[i].started = true;
+        else
+            add_chunk(&chunks[i]);
+    }
+
+    add_chunk(&chunks[0]);
+    merge_acc(acc, &chunks[0].acc);
+    for (i = 1; i < n; i++) {
+        if (chunks[i].started)
+            pthread_join(chunks[i].tid, NULL);
+        merge_acc(acc, &chunks[i].acc);
+    }
+
+    free(chunks);
+    munmap((void *)map, size);
+}
+
+// Pipes and terminals are read in blocks. The partial line at the end
+// of a block is moved to the start for the next read.
+static void add_stream(const char *name, int fd, struct acc *acc)
+{
+    size_t size = 1024 * 1024, used = 0;
+    char *buf, *last;
+    ssize_t nread;
+
+    if ((buf = malloc(size)) == NULL)
+        die("Out of memory\n");
+
+    for (;;) {
+        if ((nread = read(fd, buf + used, size - used)) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            die("%s: %s\n", name, strerror(errno));
+        }
+
+        if (nread == 0)
+            break;
+
+        used += nread;
+        if ((last = memrchr(buf, '\n', used)) == NULL) {
+            if (used == size) {
+                size *= 2;
+                if ((buf = realloc(buf, size)) == NULL)
+                    die("Out of memory\n");
+            }
+
+            continue;
+        }
+
+        last++;
+        add_lines(buf, last, acc);
+        used -= last - buf;
+        memmove(buf, last, used);
+    }
+
+    add_lines(buf, buf + used, acc);
+    free(buf);
+}
+
+static void add_file(const char *name, int fd, struct acc *acc)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        add_mapped(name, fd, st.st_size, acc);
+    else
+        add_stream(name, fd, acc);
+}
+
+static void print_wide(sum_t v)
+{
+    usum_t u = v < 0 ? -(usum_t)v : (usum_t)v;
+    char buf[64], *p = buf + sizeof buf;
+
+    if (v >= LLONG_MIN && v <= LLONG_MAX) {
+        printf("%lld", (long long)v);
+        return;
+    }
+
+    *--p = '\0';
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u != 0);
+
+    if (v < 0)
+        *--p = '-';
+
+    printf("%s", p);
+}
+
+static void print_sum(sum_t sum)
+{
+    static bool warned;
+
+    if (!warned && (sum < LLONG_MIN || sum > LLONG_MAX)) {
+        warning("The sum doesn't fit in 64 bits\n");
+        warned = true;
+    }
+
+    print_wide(sum);
+}
+
+static void print_stats(const struct stats *st)
+{
+    size_t i;
+
+    for (i = 0; i < g_naggs; i++) {
+        if (i > 0)
+            putchar('\t');
+
+        switch (g_aggs[i]) {
+            case AGG_COUNT:
+                printf("%llu", st->count);
+                break;
+
+            case AGG_SUM:
+                print_sum(st->sum);
+                break;
+
+            case AGG_MIN:
+            case AGG_MAX:
+                if (st->count == 0)
+                    putchar('-');
+                else
+                    print_wide(g_aggs[i] == AGG_MIN ? st->min : st->max);
+                break;
+
+            case AGG_MEAN:
+                if (st->count == 0)
+                    putchar('-');
+                else
+                    printf("%.15g", (double)((long double)st->sum / st->count));
+                break;
+
+            case AGG_STDDEV:
+                if (st->count == 0)
+                    putchar('-');
+                else
+                    printf("%.15g", sqrt(st->m2 / st->count));
+                break;
+        }
+    }
+
+    putchar('\n');
+}
+
+static struct acc *sort_acc;
+
+static int cmp_groups(const void *a, const void *b)
+{
+    const struct group *ga = a, *gb = b;
+
+    return strcmp(&sort_acc->keys[ga->key], &sort_acc->keys[gb->key]);
+}
+
+static void print_acc(struct acc *a)
+{
+    size_t i, n = 0;
+
+    if (g_keyfield == 0) {
+        print_stats(&a->total);
+        return;
+    }
+
+    // Pack the groups, and sort them by key.
+    for (i = 0; i < a->nslots; i++) {
+        if (a->groups[i].key != 0)
+            a->groups[n++] = a->groups[i];
+    }
+
+    sort_acc = a;
+    qsort(a->groups, n, sizeof *a->groups, cmp_groups);
+    for (i = 0; i < n; i++) {
+        printf("%s\t", &a->keys[a->groups[i].key]);
+        print_stats(&a->groups[i].st);
+    }
+}
+
+static void parse_aggregates(const char *list)
+{
+    const char *p = list;
+    size_t i, n;
+
+    g_naggs = 0;
+    while (*p != '\0') {
+        n = strcspn(p, ",");
+        for (i = 0; i < sizeof aggnames / sizeof *aggnames; i++) {
+            if (strlen(aggnames[i]) == n && strncmp(aggnames[i], p, n) == 0)
+                break;
+        }
+
+        if (i == sizeof aggnames / sizeof *aggnames)
+            die("-a: Unknown aggregate %.*s\n", (int)n, p);
+
+        if (g_naggs == sizeof g_aggs / sizeof *g_aggs)
+            die("-a: Too many aggregates\n");
+
+        g_aggs[g_naggs++] = i;
+        if (i == AGG_STDDEV)
+            g_welford = true;
+
+        p += n;
+        if (*p == ',')
+            p++;
+    }
+
+    if (g_naggs == 0)
+        die("-a: No aggregates\n");
+}
+
+static void parse_commandline(int argc, char *argv[])
+{
+    int c;
+    const char *options = "hj:f:d:k:a:";
+
+    while ((c = getopt(argc, argv, options)) != EOF) {
+        switch (c) {
+            case 'h':
+                show_usage();
+                exit(0);
+
+            case 'j':
+                g_nthreads = atol(optarg);
+                if (g_nthreads < 1)
+                    die("-j: need at least one thread\n");
+                break;
+
+            case 'f':
+                if ((g_field = atoi(optarg)) < 1)
+                    die("-f: Fields are counted from 1\n");
+                break;
+
+            case 'k':
+                if ((g_keyfield = atoi(optarg)) < 1)
+                    die("-k: Fields are counted from 1\n");
+                break;
+
+            case 'd':
+                if (strlen(optarg) != 1 || *optarg == '\n')
+                    die("-d: The delimiter must be one character\n");
+                g_delim = *optarg;
+                break;
+
+            case 'a':
+                parse_aggregates(optarg);
+                break;
+
+            case '?':
+            default:
+                exit(1);
+        }
+    }
+
+    if (g_field == 0 && (g_delim != '\0' || g_keyfield != 0))
+        g_field = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct acc result;
+    int fd;
+
+    memset(&result, 0, sizeof result);
+    parse_commandline(argc, argv);
+
+    if (optind == argc)
+        add_file("stdin", STDIN_FILENO, &result);
+
+    for (; optind < argc; optind++) {
+        if (strcmp(argv[optind], "-") == 0) {
+            add_file("stdin", STDIN_FILENO, &result);
+            continue;
+        }
+
+        if ((fd = open(argv[optind], O_RDONLY)) == -1)
+            die("%s: %s\n", argv[optind], strerror(errno));
+
+        add_file(argv[optind], fd, &result);
+        close(fd);
     }
 
-    printf("%lld\n", result);
+    print_acc(&result);
 
     exit(0);
 }
@@ -0,0 +1,393 @@
+// benchdup -- run the duplicate finders against a tree and measure them.
+// Each tool runs with a cold and a warm page cache. We record wall time,
+// bytes read (rchar from /proc/pid/io, i.e., what the tool asked for),
+// bytes read from disk (ru_inblock) and peak RSS.
+//
+// With -b, results are compared to a baseline file. If the baseline
+// doesn't exist, we create it. Regressions beyond the tolerance make
+// us exit with a non-zero status, so this can run from make.
+//
+// Cold cache means dropping the page cache. That needs root, so if we
+// can't write to /proc/sys/vm/drop_caches, we evict the tree's files
+// one by one with posix_fadvise(POSIX_FADV_DONTNEED) instead.
+//
+// boa@20261019
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static char bindir[PATH_MAX] = ".";
+static const char *baseline;
+static unsigned nruns = 3;
+static double tolerance = 10.0; // percent
+static char tree[PATH_MAX];
+
+struct result {
+    char tool[64];
+    char mode[8];
+    double wall;                  // seconds, median of nruns
+    unsigned long long rchar;     // bytes requested by read() and friends
+    unsigned long long diskbytes; // bytes actually read from disk
+    long maxrss;                  // KB
+};
+
+static struct result results[16];
+static size_t nresults;
+
+__attribute__((format(printf,1,2)))
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static int evict_callback(const char *fpath, const struct stat *sb,
+    int typeflag __attribute__((unused)),
+    struct FTW *ftwbuf __attribute__((unused)))
+{
+    int fd;
+
+    if (!S_ISREG(sb->st_mode))
+        return 0;
+
+    if ((fd = open(fpath, O_RDONLY)) != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void drop_caches(void)
+{
+    FILE *f;
+
+    sync();
+    if ((f = fopen("/proc/sys/vm/drop_caches", "w")) != NULL) {
+        fputs("3\n", f);
+        if (fclose(f) == 0)
+            return;
+    }
+
+    nftw(tree, evict_callback, 12, FTW_PHYS);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The child is a zombie when we get here, so its io counters are final.
+static unsigned long long read_rchar(pid_t pid)
+{
+    char path[64], line[128];
+    unsigned long long rchar = 0;
+    FILE *f;
+
+    snprintf(path, sizeof path, "/proc/%d/io", (int)pid);
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "rchar: %llu", &rchar) == 1)
+            break;
+    }
+
+    fclose(f);
+    return rchar;
+}
+
+// Run argv in workdir with stdout discarded. Tools like dupdate write
+// their database to the current directory, so workdir is a scratch dir.
+static void run(char *const argv[], const char *workdir, struct result *r)
+{
+    siginfo_t info;
+    struct rusage ru;
+    int status;
+    double start = now();
+    pid_t pid;
+
+    if ((pid = fork()) == -1)
+        die("fork: %s\n", strerror(errno));
+
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1 || chdir(workdir) == -1)
+            _exit(127);
+
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1)
+        die("waitid: %s\n", strerror(errno));
+
+    r->wall = now() - start;
+    r->rchar = read_rchar(pid);
+
+    if (wait4(pid, &status, 0, &ru) == -1)
+        die("wait4: %s\n", strerror(errno));
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        fprintf(stderr, "warning: %s exited with status %d\n", argv[0], status);
+
+    r->diskbytes = ru.ru_inblock * 512ULL;
+    r->maxrss = ru.ru_maxrss;
+}
+
+static int cmp_double(const void *v1, const void *v2)
+{
+    const double *d1 = v1, *d2 = v2;
+    return (*d1 > *d2) - (*d1 < *d2);
+}
+
+static void bench(const char *tool, char *const args[], const char *workdir)
+{
+    static const char *modes[] = { "cold", "warm" };
+    char path[PATH_MAX + 64];
+    char *argv[8];
+    double walls[32];
+    size_t i, m;
+    unsigned n;
+
+    snprintf(path, sizeof path, "%s/%s", bindir, tool);
+    if (access(path, X_OK) == -1) {
+        fprintf(stderr, "warning: skipping %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    argv[0] = path;
+    for (i = 0; args[i] != NULL && i < 6; i++)
+        argv[i + 1] = args[i];
+    argv[i + 1] = NULL;
+
+    for (m = 0; m < sizeof modes / sizeof *modes; m++) {
+        struct result *r = &results[nresults++];
+
+        snprintf(r->tool, sizeof r->tool, "%s", tool);
+        snprintf(r->mode, sizeof r->mode, "%s", modes[m]);
+
+        // Warm up the cache once, so the first warm run isn't cold.
+        if (m == 1)
+            run(argv, workdir, r);
+
+        // Byte counts and RSS don't vary much, so we keep the last run's.
+        for (n = 0; n < nruns; n++) {
+            if (m == 0)
+                drop_caches();
+
+            run(argv, workdir, r);
+            walls[n] = r->wall;
+        }
+
+        qsort(walls, nruns, sizeof *walls, cmp_double);
+        r->wall = walls[nruns / 2];
+    }
+}
+
+static void print_result(FILE *f, const struct result *r)
+{
+    fprintf(f, "%-22s %-5s %10.3f %15llu %15llu %10ld\n",
+        r->tool, r->mode, r->wall, r->rchar, r->diskbytes, r->maxrss);
+}
+
+static double delta(double now, double then)
+{
+    return then > 0 ? (now - then) * 100.0 / then : 0.0;
+}
+
+// Returns the number of regressions.
+static int compare(FILE *f)
+{
+    struct result b;
+    char line[512];
+    size_t i;
+    int nregressions = 0;
+
+    printf("\n%-22s %-5s %10s %10s %10s %10s\n", "vs baseline", "mode",
+        "wall%", "rchar%", "disk%", "rss%");
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "%63s %7s %lf %llu %llu %ld", b.tool, b.mode,
+          &b.wall, &b.rchar, &b.diskbytes, &b.maxrss) != 6)
+            continue;
+
+        for (i = 0; i < nresults; i++) {
+            const struct result *r = &results[i];
+            bool regressed;
+
+            if (strcmp(r->tool, b.tool) != 0 || strcmp(r->mode, b.mode) != 0)
+                continue;
+
+            // mmap() doesn't show up in rchar, so disk bytes matter too.
+            regressed = delta(r->wall, b.wall) > tolerance
+                || delta(r->rchar, b.rchar) > tolerance
+                || delta(r->diskbytes, b.diskbytes) > tolerance
+                || delta(r->maxrss, b.maxrss) > tolerance;
+
+            printf("%-22s %-5s %+9.1f%% %+9.1f%% %+9.1f%% %+9.1f%%%s\n", r->tool, r->mode,
+                delta(r->wall, b.wall), delta(r->rchar, b.rchar),
+                delta(r->diskbytes, b.diskbytes), delta(r->maxrss, b.maxrss),
+                regressed ? "  REGRESSION" : "");
+
+            nregressions += regressed;
+        }
+    }
+
+    return nregressions;
+}
+
+static void show_usage(void)
+{
+    static const char *text[] = {
+        "USAGE: benchdup [options] tree",
+        "",
+        "Run find_duplicate_files, dupdate and find_unique_files on tree,",
+        "which is typically made by gentree, and report their resource usage.",
+        "",
+        "options",
+        "-B dir      Directory containing the tools (.)",
+        "-r runs     Runs per tool and cache mode. We report the median (3)",
+        "-b file     Compare to baseline in file, or create it if missing",
+        "-t percent  Tolerance before a difference is a regression (10)",
+        "",
+    };
+
+    size_t i, n = sizeof text / sizeof *text;
+    for (i = 0; i < n; i++)
+        puts(text[i]);
+}
+
+static void parse_command_line(int argc, char *argv[])
+{
+    int c;
+    const char *options = "hB:r:b:t:";
+
+    while ((c = getopt(argc, argv, options)) != -1) {
+        switch (c) {
+            case 'h':
+                show_usage();
+                exit(EXIT_SUCCESS);
+
+            case 'B':
+                if (realpath(optarg, bindir) == NULL)
+                    die("%s: %s\n", optarg, strerror(errno));
+                break;
+
+            case 'r':
+                nruns = atoi(optarg);
+                if (nruns < 1 || nruns > 32)
+                    die("runs must be between 1 and 32\n");
+                break;
+
+            case 'b':
+                baseline = optarg;
+                break;
+
+            case 't':
+                tolerance = atof(optarg);
+                break;
+
+            case '?':
+            default:
+                show_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 1) {
+        show_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // The tools run in a scratch directory, so we need absolute paths.
+    if (strcmp(bindir, ".") == 0 && getcwd(bindir, sizeof bindir) == NULL)
+        die("getcwd: %s\n", strerror(errno));
+
+    if (realpath(argv[optind], tree) == NULL)
+        die("%s: %s\n", argv[optind], strerror(errno));
+}
+
+int main(int argc, char *argv[])
+{
+    char workdir[] = "/tmp/benchdup.XXXXXX";
+    char evaldir[PATH_MAX + 4], dupdb[sizeof workdir + 8];
+    struct stat st;
+    size_t i;
+    FILE *f;
+    int status = EXIT_SUCCESS;
+
+    parse_command_line(argc, argv);
+
+    if (mkdtemp(workdir) == NULL)
+        die("mkdtemp: %s\n", strerror(errno));
+
+    // find_unique_files compares the tree to one of its subdirectories.
+    snprintf(evaldir, sizeof evaldir, "%s/d0", tree);
+
+    {
+        char *fdf_args[] = { "-s", tree, NULL };
+        // Without -a, every run after the first would reuse the database
+        // from the last one and only check that nothing changed.
+        char *dupdate_args[] = { "-a", "-s", tree, NULL };
+        char *fuf_args[] = { "-s", tree, evaldir, NULL };
+
+        bench("find_duplicate_files", fdf_args, workdir);
+        bench("dupdate", dupdate_args, workdir);
+
+        if (stat(evaldir, &st) == 0 && S_ISDIR(st.st_mode))
+            bench("find_unique_files", fuf_args, workdir);
+    }
+
+    snprintf(dupdb, sizeof dupdb, "%s/.dupdb", workdir);
+    unlink(dupdb);
+    rmdir(workdir);
+
+    printf("%-22s %-5s %10s %15s %15s %10s\n", "tool", "mode", "wall(s)", "rchar", "diskbytes", "maxrss(KB)");
+    for (i = 0; i < nresults; i++)
+        print_result(stdout, &results[i]);
+
+    if (baseline == NULL)
+        return status;
+
+    if ((f = fopen(baseline, "r")) != NULL) {
+        if (compare(f) > 0)
+            status = EXIT_FAILURE;
+        fclose(f);
+    }
+    else if (errno == ENOENT) {
+        if ((f = fopen(baseline, "w")) == NULL)
+            die("%s: %s\n", baseline, strerror(errno));
+
+        for (i = 0; i < nresults; i++)
+            print_result(f, &results[i]);
+
+        fclose(f);
+        printf("\nSaved baseline to %s\n", baseline);
+    }
+    else
+        die("%s: %s\n", baseline, strerror(errno));
+
+    return status;
+}
@@ -0,0 +1,367 @@
+// gentree -- generate a synthetic directory tree for benchmarking the
+// duplicate finders. Same options and seed gives the same tree, byte
+// for byte, so runs on different versions of the tools are comparable.
+//
+// The tree contains a mix of
+// - unique files
+// - duplicates, i.e., copies of an earlier file
+// - hard links to an earlier file
+// - sparse files, with data only in the first and last 4K
+// - collisions: same size as an earlier file, same first 4K (or half
+//   the file, if it's small), but different content after that.
+//   These are the files which make tiered hashing work hard.
+//
+// File sizes are log-uniformly distributed between -m and -M, so small
+// files dominate the count and big files dominate the byte count, like
+// in real trees.
+//
+// boa@20261019
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+static unsigned long nfiles = 1000;
+static uint64_t seed = 1;
+static unsigned depth = 4;
+static unsigned fanout = 8;
+static uint64_t minsize = 1;
+static uint64_t maxsize = 1024 * 1024;
+static double dup_ratio = 0.2;
+static double hardlink_ratio = 0.05;
+static double sparse_ratio = 0.02;
+static double collision_ratio = 0.05;
+static const char *rootdir;
+
+// What we remember about each file, so later files can refer to it.
+struct file {
+    char *path;
+    uint64_t size;
+    uint64_t id;        // Content id. Equal ids means equal contents.
+    uint64_t prefix_id; // Content id for the prefix. Same as id, except for collisions.
+    bool sparse;
+};
+
+static struct file *files;
+
+static struct {
+    unsigned long unique, dups, hardlinks, sparse, collisions;
+    uint64_t bytes;
+} counts;
+
+__attribute__((format(printf,1,2)))
+static void die(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+// splitmix64. Small, fast and good enough for test data.
+static inline uint64_t next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t rng;
+
+static inline double uniform(void)
+{
+    return (next(&rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Pick a bit length uniformly, then a size with that bit length.
+static uint64_t random_size(void)
+{
+    unsigned lo = 63 - __builtin_clzll(minsize), hi = 63 - __builtin_clzll(maxsize);
+    unsigned bits = lo + next(&rng) % (hi - lo + 1);
+    uint64_t from = (uint64_t)1 << bits, to = (from << 1) - 1;
+
+    if (from < minsize)
+        from = minsize;
+    if (to > maxsize)
+        to = maxsize;
+
+    return from + next(&rng) % (to - from + 1);
+}
+
+// Fill buf with the bytes at [offset, offset + len) of content id.
+// offset is always a multiple of 8.
+static void fill(char *buf, size_t len, uint64_t id, uint64_t offset)
+{
+    uint64_t state = seed ^ (id * 0xd1b54a32d192ed03ULL), v;
+    size_t i;
+
+    // Each 8-byte word is a function of its position, so we can start anywhere.
+    for (i = 0; i < len; i += sizeof v) {
+        uint64_t s = state + (offset + i) / sizeof v * 0x9e3779b97f4a7c15ULL;
+
+        v = next(&s);
+        memcpy(&buf[i], &v, len - i < sizeof v ? len - i : sizeof v);
+    }
+}
+
+static void write_range(int fd, const char *path, uint64_t from, uint64_t to, const struct file *f)
+{
+    static char buf[65536];
+    uint64_t prefix = f->size > 4096 ? 4096 : (f->size / 2) & ~(uint64_t)7;
+
+    while (from < to) {
+        size_t n = to - from < sizeof buf ? to - from : sizeof buf;
+        uint64_t id = f->id;
+
+        // Keep each chunk within the prefix or outside of it.
+        if (from < prefix) {
+            id = f->prefix_id;
+            if (n > prefix - from)
+                n = prefix - from;
+        }
+
+        fill(buf, n, id, from);
+        if (pwrite(fd, buf, n, from) != (ssize_t)n)
+            die("%s: %s\n", path, strerror(errno));
+
+        from += n;
+    }
+}
+
+static void write_file(const struct file *f)
+{
+    int fd;
+
+    if ((fd = open(f->path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1)
+        die("%s: %s\n", f->path, strerror(errno));
+
+    if (f->sparse && f->size > 8192) {
+        if (ftruncate(fd, f->size) == -1)
+            die("%s: %s\n", f->path, strerror(errno));
+
+        write_range(fd, f->path, 0, 4096, f);
+        write_range(fd, f->path, (f->size - 4096) & ~(uint64_t)7, f->size, f);
+    }
+    else
+        write_range(fd, f->path, 0, f->size, f);
+
+    if (close(fd) == -1)
+        die("%s: %s\n", f->path, strerror(errno));
+
+    counts.bytes += f->size;
+}
+
+static void mkdirs(char *path)
+{
+    char *s;
+
+    for (s = strchr(path + 1, '/'); s != NULL; s = strchr(s + 1, '/')) {
+        *s = '\0';
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
+            die("%s: %s\n", path, strerror(errno));
+        *s = '/';
+    }
+}
+
+// A random directory at a random depth, then the file name.
+static char *random_path(unsigned long i)
+{
+    char path[4096];
+    size_t len;
+    unsigned d, n = next(&rng) % (depth + 1);
+    char *result;
+
+    len = snprintf(path, sizeof path, "%s", rootdir);
+    for (d = 0; d < n; d++)
+        len += snprintf(&path[len], sizeof path - len, "/d%u", (unsigned)(next(&rng) % fanout));
+
+    snprintf(&path[len], sizeof path - len, "/f%lu", i);
+    mkdirs(path);
+
+    if ((result = strdup(path)) == NULL)
+        die("Out of memory\n");
+
+    return result;
+}
+
+static void generate(void)
+{
+    unsigned long i;
+    uint64_t next_id = 1;
+
+    if ((files = calloc(nfiles, sizeof *files)) == NULL)
+        die("Out of memory\n");
+
+    for (i = 0; i < nfiles; i++) {
+        struct file *f = &files[i];
+        double r = uniform();
+
+        f->path = random_path(i);
+
+        // Pick an earlier file to copy, link or collide with. Earlier
+        // collisions and duplicates are fine sources too.
+        const struct file *src = i > 0 ? &files[next(&rng) % i] : NULL;
+
+        if (src != NULL && r < hardlink_ratio) {
+            char *path = f->path;
+
+            if (link(src->path, path) == -1)
+                die("%s: %s\n", path, strerror(errno));
+
+            *f = *src;
+            f->path = path;
+            counts.hardlinks++;
+            continue;
+        }
+
+        r -= hardlink_ratio;
+        if (src != NULL && r < dup_ratio) {
+            char *path = f->path;
+
+            *f = *src;
+            f->path = path;
+            counts.dups++;
+        }
+        else if (src != NULL && r - dup_ratio < collision_ratio) {
+            f->size = src->size;
+            f->prefix_id = src->prefix_id;
+            f->id = next_id++;
+            f->sparse = src->sparse;
+            counts.collisions++;
+        }
+        else if (r - dup_ratio - collision_ratio < sparse_ratio) {
+            f->size = random_size();
+            f->id = f->prefix_id = next_id++;
+            f->sparse = true;
+            counts.sparse++;
+        }
+        else {
+            f->size = random_size();
+            f->id = f->prefix_id = next_id++;
+            counts.unique++;
+        }
+
+        write_file(f);
+    }
+}
+
+static void show_usage(void)
+{
+    static const char *text[] = {
+        "USAGE: gentree [options] directory",
+        "",
+        "Generate a deterministic tree of files in directory, which must not exist.",
+        "",
+        "options",
+        "-n count      Number of files (1000)",
+        "-s seed       Random seed (1)",
+        "-d depth      Max directory depth (4)",
+        "-f fanout     Subdirectories per directory (8)",
+        "-m size       Min file size (1)",
+        "-M size       Max file size (1048576)",
+        "-D ratio      Fraction of files which are duplicates (0.2)",
+        "-H ratio      Fraction of files which are hard links (0.05)",
+        "-S ratio      Fraction of files which are sparse (0.02)",
+        "-C ratio      Fraction of files which collide in size and 4K prefix (0.05)",
+        "",
+    };
+
+    size_t i, n = sizeof text / sizeof *text;
+    for (i = 0; i < n; i++)
+        puts(text[i]);
+}
+
+static double ratio(const char *s)
+{
+    char *end;
+    double d = strtod(s, &end);
+
+    if (*end != '\0' || d < 0.0 || d > 1.0)
+        die("Illegal ratio %s\n", s);
+
+    return d;
+}
+
+static uint64_t number(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 0);
+
+    if (*end != '\0' || *s == '-')
+        die("Illegal number %s\n", s);
+
+    return n;
+}
+
+static void parse_command_line(int argc, char *argv[])
+{
+    int c;
+    const char *options = "hn:s:d:f:m:M:D:H:S:C:";
+
+    while ((c = getopt(argc, argv, options)) != -1) {
+        switch (c) {
+            case 'h':
+                show_usage();
+                exit(EXIT_SUCCESS);
+
+            case 'n': nfiles = number(optarg); break;
+            case 's': seed = number(optarg); break;
+            case 'd': depth = number(optarg); break;
+            case 'f': fanout = number(optarg); break;
+            case 'm': minsize = number(optarg); break;
+            case 'M': maxsize = number(optarg); break;
+            case 'D': dup_ratio = ratio(optarg); break;
+            case 'H': hardlink_ratio = ratio(optarg); break;
+            case 'S': sparse_ratio = ratio(optarg); break;
+            case 'C': collision_ratio = ratio(optarg); break;
+
+            case '?':
+            default:
+                show_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 1) {
+        show_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (minsize == 0 || minsize > maxsize || fanout == 0)
+        die("Illegal size range or fanout\n");
+
+    if (dup_ratio + hardlink_ratio + sparse_ratio + collision_ratio > 1.0)
+        die("The ratios add up to more than 1\n");
+
+    rootdir = argv[optind];
+}
+
+int main(int argc, char *argv[])
+{
+    parse_command_line(argc, argv);
+
+    if (mkdir(rootdir, 0755) == -1)
+        die("%s: %s\n", rootdir, strerror(errno));
+
+    rng = seed;
+    generate();
+
+    fprintf(stderr, "%lu files, %llu bytes: %lu unique, %lu dups, %lu hardlinks, "
+        "%lu sparse, %lu collisions\n", nfiles, (unsigned long long)counts.bytes,
+        counts.unique, counts.dups, counts.hardlinks, counts.sparse, counts.collisions);
+
+    return 0;
+}
@@ -1,40 +1,120 @@
 /* Update the duplicates database.
  * locates identical files, possibly with a different name.  */
 #include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ftw.h>
 #include <gcrypt.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "dupdb.h"
+#include "hashpool.h"
+#include "journal.h"
+#include "watch.h"
+
 int ftw_flags = FTW_ACTIONRETVAL | FTW_STOP | FTW_PHYS;
 int verbose = 0;
 int debug = 0;
 int silent = 0; // print error messages? (Some will always be printed)
+const char *dbfile = ".dupdb";
+int rehash_all = 0; // Ignore the previous database?
+
+// The previous database, if any. Files which haven't changed since then
+// keep their digest.
+static struct dupdb *olddb;
+
+static struct {
+    unsigned long reused, hashed, resumed;
+} counts;
+
+// Everything we find is appended to a journal, and every now and then we
+// write a checkpoint. The checkpoint says how much of the journal is on
+// disk, and how many search directories we've completed. See --resume.
+static struct journal *journal;
+static char journalfile[PATH_MAX], checkpointfile[PATH_MAX];
+static int resume = 0;
+static unsigned checkpoint_interval = 60; // seconds
+static size_t curdir;     // Index of the search directory we're in
+static size_t firstdir;   // First directory to traverse. Non-zero if we resume.
+
+// When resuming, these are the journal's entries for the directory we
+// were in when we were interrupted, sorted by path. We keep copies of
+// the records, as the hashing threads may move the entries.
+struct resumed {
+    const char *path;
+    struct dupdb_record rec;
+    size_t entry;
+};
+
+static struct resumed *resumed;
+static size_t nresumed;
+static bool *resumed_seen;
+
+// Files are hashed on a pool of threads. The pool's writer thread is the
+// only one to touch the entries and the journal while we traverse.
+static struct hashpool *pool;
+static unsigned nthreads = 0; // 0 means one per CPU
+static const uint64_t max_inflight = 256 * 1024 * 1024;
+
+// With --watch, we keep running after the first scan, and update the
+// database when files change. Changed paths are collected as dirty, and
+// handled once things have been quiet for watch_delay seconds.
+static struct watch *watcher;
+static unsigned watch_delay = 0; // seconds. 0 means don't watch.
+
+struct dirty {
+    char *path;
+    bool dir; // A removed directory
+
+    // Set by flush_dirty() for files to hash. entry is the index of the
+    // file's entry, or -1 if it's new.
+    bool hash;
+    long entry;
+    struct stat sb;
+};
+
+static struct dirty *dirty;
+static size_t ndirty, ndirty_max;
+static bool overflowed;
+static volatile sig_atomic_t stop;
 
 // We store the directories to traverse in an array.
 const char *searchdirs[10240];
 size_t nsearchdirs = 0;
 
-// We store paths and hash values in structs like this:
-struct entry {
-    char *fpath;
-    char *hash;
-};
-struct entry *entries = NULL;
+// We store paths, hash values and stat info in dupdb entries.
+struct dupdb_entry *entries = NULL;
 size_t nentries_max = 0; // How many have we allocated room for?
 size_t nentries_used = 0; // How many has been used?
 
 size_t initial_nentries = 300000; // We start off supporting that many entries
 
-static void add_entry(const char *fpath, char *hash)
+static void set_record(struct dupdb_record *rec, const struct stat *sb, const unsigned char *digest)
 {
+    memcpy(rec->digest, digest, sizeof rec->digest);
+    rec->mtime_nsec = sb->st_mtim.tv_nsec;
+    rec->path_id = 0;
+    rec->size = sb->st_size;
+    rec->mtime_sec = sb->st_mtim.tv_sec;
+    rec->dev = sb->st_dev;
+    rec->ino = sb->st_ino;
+}
+
+static void add_entry(const char *fpath, const struct stat *sb, const unsigned char *digest)
+{
+
     if (nentries_max == 0) {
         // first entry.
         if ((entries = malloc(sizeof *entries * initial_nentries)) == NULL) {
@@ -46,7 +126,7 @@ static void add_entry(const char *fpath, char *hash)
     }
     else if (nentries_used == nentries_max) {
         // reallocate
-        struct entry *tmp;
+        struct dupdb_entry *tmp;
         size_t new_size = nentries_max * 2 * sizeof *entries;
 
         if ((tmp = realloc(entries, new_size)) == NULL) {
@@ -57,25 +137,346 @@ static void add_entry(const char *fpath, char *hash)
         nentries_max *= 2;
     }
 
-    // Add element. Note that we create a copy of fpath, but *NOT* of
-    // hash, since the callback function allocated room for hash.
-    if ((entries[nentries_used].fpath = strdup(fpath)) == NULL) {
+    if ((entries[nentries_used].path = strdup(fpath)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (sb != NULL)
+        set_record(&entries[nentries_used].rec, sb, digest);
+
+    nentries_used++;
+}
+
+// Remove entries with a NULL path.
+static void compact_entries(void)
+{
+    size_t i, n;
+
+    for (i = n = 0; i < nentries_used; i++) {
+        if (entries[i].path != NULL)
+            entries[n++] = entries[i];
+    }
+
+    nentries_used = n;
+}
+
+static void journal_entry(const struct dupdb_entry *e)
+{
+    if (journal_append(journal, e, curdir) == -1) {
+        perror(journalfile);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Sync the journal, then record how much of it is on disk and how many
+// directories we've completed. The checkpoint is replaced atomically.
+static void write_checkpoint(size_t ndone)
+{
+    char tmpname[PATH_MAX + 8];
+    uint64_t length;
+    size_t i;
+    FILE *f;
+
+    if (journal_sync(journal, &length) == -1) {
+        perror(journalfile);
+        exit(EXIT_FAILURE);
+    }
+
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", checkpointfile);
+    if ((f = fopen(tmpname, "w")) == NULL) {
+        perror(tmpname);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(f, "dupdate checkpoint 1\njournal %llu\ndone %zu\nndirs %zu\n",
+        (unsigned long long)length, ndone, nsearchdirs);
+    for (i = 0; i < nsearchdirs; i++)
+        fprintf(f, "dir %s\n", searchdirs[i]);
+
+    if (fflush(f) == EOF || fsync(fileno(f)) == -1 || fclose(f) == EOF || rename(tmpname, checkpointfile) == -1) {
+        perror(checkpointfile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (debug)
+        fprintf(stderr, "Checkpoint: %llu journal bytes, %zu dirs done\n", (unsigned long long)length, ndone);
+}
+
+static void maybe_checkpoint(void)
+{
+    static time_t last;
+    time_t now = time(NULL);
+
+    if (last == 0)
+        last = now;
+
+    if (now - last >= (time_t)checkpoint_interval) {
+        write_checkpoint(curdir);
+        last = now;
+    }
+}
+
+// Read the checkpoint. Returns the number of journal bytes to trust.
+static uint64_t read_checkpoint(void)
+{
+    char line[PATH_MAX + 16], *s;
+    unsigned long long length;
+    size_t i, ndone, ndirs;
+    FILE *f;
+
+    if ((f = fopen(checkpointfile, "r")) == NULL) {
+        perror(checkpointfile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fgets(line, sizeof line, f) == NULL || strcmp(line, "dupdate checkpoint 1\n") != 0
+    || fscanf(f, "journal %llu\n", &length) != 1
+    || fscanf(f, "done %zu\n", &ndone) != 1
+    || fscanf(f, "ndirs %zu\n", &ndirs) != 1
+    || ndone > ndirs || ndirs > sizeof searchdirs / sizeof *searchdirs)
+        goto corrupt;
+
+    if (nsearchdirs != 0 && nsearchdirs != ndirs) {
+        fprintf(stderr, "error: The directories differ from the ones in %s\n", checkpointfile);
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < ndirs; i++) {
+        if (fgets(line, sizeof line, f) == NULL || strncmp(line, "dir ", 4) != 0)
+            goto corrupt;
+
+        line[strcspn(line, "\n")] = '\0';
+        if (nsearchdirs == ndirs) {
+            if (strcmp(searchdirs[i], line + 4) != 0) {
+                fprintf(stderr, "error: The directories differ from the ones in %s\n", checkpointfile);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if ((s = strdup(line + 4)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        else
+            searchdirs[i] = s;
+    }
+
+    fclose(f);
+    nsearchdirs = ndirs;
+    firstdir = ndone;
+    return length;
+
+corrupt:
+    fprintf(stderr, "%s: Corrupt checkpoint\n", checkpointfile);
+    exit(EXIT_FAILURE);
+}
+
+static uint32_t *loaded_dirs; // Directory of each entry loaded from the journal
+
+static void load_journal_entry(const struct dupdb_entry *e, uint32_t diridx, void *arg __attribute__((unused)))
+{
+    uint32_t *tmp;
+
+    add_entry(e->path, NULL, NULL);
+    entries[nentries_used - 1].rec = e->rec;
+
+    if ((tmp = realloc(loaded_dirs, nentries_max * sizeof *loaded_dirs)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    loaded_dirs = tmp;
+    loaded_dirs[nentries_used - 1] = diridx;
+}
+
+// Sort entry indexes by path. Equal paths are ordered by index, so the
+// last one in the journal is the last one in the run.
+static int cmp_entry_path(const void *v1, const void *v2)
+{
+    const size_t *i1 = v1, *i2 = v2;
+    int rc = strcmp(entries[*i1].path, entries[*i2].path);
+
+    return rc != 0 ? rc : (*i1 > *i2) - (*i1 < *i2);
+}
+
+static size_t *sorted_by_path(size_t *n)
+{
+    size_t i, *idx;
+
+    if ((idx = malloc((nentries_used + 1) * sizeof *idx)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nentries_used; i++)
+        idx[i] = i;
+
+    qsort(idx, nentries_used, sizeof *idx, cmp_entry_path);
+    *n = nentries_used;
+    return idx;
+}
+
+// Load the journal of an interrupted run. Entries for completed directories
+// are used as is. Entries for the directory we were in are verified while
+// we traverse that directory again.
+static void load_resume_state(void)
+{
+    uint64_t length = read_checkpoint();
+    size_t i, n, *idx;
+
+    if (journal_load(journalfile, length, load_journal_entry, NULL) == -1) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: Corrupt journal\n", journalfile);
+        else
+            perror(journalfile);
+        exit(EXIT_FAILURE);
+    }
+
+    // A file may be in the journal twice, if it changed between the
+    // interruption and a previous resume. The last version wins.
+    idx = sorted_by_path(&n);
+    for (i = 1; i < n; i++) {
+        if (strcmp(entries[idx[i - 1]].path, entries[idx[i]].path) == 0) {
+            free(entries[idx[i - 1]].path);
+            entries[idx[i - 1]].path = NULL;
+        }
+    }
+
+    for (i = 0; i < nentries_used; i++) {
+        if (entries[i].path != NULL && loaded_dirs[i] > firstdir) {
+            fprintf(stderr, "%s: Entries from directories we hadn't started on\n", journalfile);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Forget entries from other directories than the one we resume in.
+    for (i = n = 0; i < nentries_used; i++) {
+        if (entries[i].path != NULL)
+            loaded_dirs[n++] = loaded_dirs[i];
+    }
+
+    compact_entries();
+    free(idx);
+
+    idx = sorted_by_path(&n);
+    resumed = malloc((n + 1) * sizeof *resumed);
+    resumed_seen = calloc(n + 1, sizeof *resumed_seen);
+    if (resumed == NULL || resumed_seen == NULL) {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-    entries[nentries_used++].hash = hash;
+    for (i = nresumed = 0; i < n; i++) {
+        if (loaded_dirs[idx[i]] == firstdir) {
+            resumed[nresumed].path = entries[idx[i]].path;
+            resumed[nresumed].rec = entries[idx[i]].rec;
+            resumed[nresumed++].entry = idx[i];
+        }
+    }
+
+    free(idx);
+
+    free(loaded_dirs);
+    loaded_dirs = NULL;
+    counts.resumed = nentries_used;
+
+    if ((journal = journal_reopen(journalfile, length)) == NULL) {
+        perror(journalfile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Resuming at directory %zu of %zu with %zu files from the journal\n",
+            firstdir + 1, nsearchdirs, nentries_used);
+}
+
+// Returns the index in resumed of fpath, or nresumed if not found.
+static size_t find_resumed(const char *fpath)
+{
+    size_t lo = 0, hi = nresumed, mid;
+    int rc;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rc = strcmp(fpath, resumed[mid].path);
+        if (rc == 0)
+            return mid;
+
+        if (rc < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return nresumed;
+}
+
+static bool same_stat(const struct dupdb_record *rec, const struct stat *sb)
+{
+    return rec->size == (uint64_t)sb->st_size
+        && rec->mtime_sec == sb->st_mtim.tv_sec
+        && rec->mtime_nsec == (uint32_t)sb->st_mtim.tv_nsec
+        && rec->ino == (uint64_t)sb->st_ino
+        && rec->dev == (uint64_t)sb->st_dev;
+}
+
+// Files from the journal which weren't found again are gone.
+static void forget_unseen_resumed(void)
+{
+    size_t i;
+
+    for (i = 0; i < nresumed; i++) {
+        if (!resumed_seen[i]) {
+            free(entries[resumed[i].entry].path);
+            entries[resumed[i].entry].path = NULL;
+        }
+    }
+
+    compact_entries();
+    free(resumed);
+    free(resumed_seen);
+    resumed = NULL;
+    resumed_seen = NULL;
+    nresumed = 0;
+}
+
+// Scans after the first one start from scratch, even if the first one
+// was resumed. resumed points into entries, which rescan() frees.
+static void forget_resume_state(void)
+{
+    free(resumed);
+    free(resumed_seen);
+    resumed = NULL;
+    resumed_seen = NULL;
+    nresumed = 0;
+
+    free(loaded_dirs);
+    loaded_dirs = NULL;
+
+    counts.resumed = 0;
+    firstdir = 0;
+    resume = 0;
 }
 
 static void show_usage(void)
 {
     static const char *text[] = {
-        "USAGE: find_duplicate_files [options] directory...",
+        "USAGE: dupdate [options] directory...",
         "",
-        "The program will locate ALL files in the directories specified.",
-        "Then it will compare the contents and report paths to duplicates.",
+        "The program will locate ALL files in the directories specified,",
+        "hash them and store the hashes in a database for dupfind.",
         "",
         "options",
+        "-f file Database file. Default is .dupdb",
+        "-a Rehash all files. By default, files with the same size, mtime",
+        "   and inode as in the existing database aren't read again.",
+        "-r, --resume Continue an interrupted run from its last checkpoint.",
+        "   The directories may be omitted, as the checkpoint has them.",
+        "-c seconds Checkpoint interval. Default is 60",
+        "-j threads Number of threads hashing files. Default is one per CPU.",
+        "-w[seconds], --watch[=seconds] Keep running, and update the database when",
+        "   files change. We wait until nothing has changed for the given",
+        "   number of seconds, 5 by default, before we update it.",
         "-x Stay on file system. Dont' traverse into mounted filesystems.",
         "-v Verbose. Print info as we progress.",
         "-s silent. Don't print (most) error messages.",
@@ -120,19 +521,50 @@ static void parse_command_line(int argc, char *argv[])
     extern char *optarg;
     extern int optind;
 
-    const char *options = "vhxds";
+    const char *options = "vhxdsarw::f:c:j:";
+    static const struct option longopts[] = {
+        { "resume", no_argument, NULL, 'r' },
+        { "watch", optional_argument, NULL, 'w' },
+        { NULL, 0, NULL, 0 }
+    };
 
     if (argc == 1) {
         show_usage();
         exit(EXIT_FAILURE);
     }
 
-    while ((c = getopt(argc, argv, options)) != -1) {
+    while ((c = getopt_long(argc, argv, options, longopts, NULL)) != -1) {
         switch (c) {
             case 'h':
                 show_usage();
                 exit(EXIT_SUCCESS);
 
+            case 'a':
+                rehash_all = 1;
+                break;
+
+            case 'r':
+                resume = 1;
+                break;
+
+            case 'c':
+                checkpoint_interval = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'j':
+                nthreads = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'w':
+                watch_delay = optarg != NULL ? strtoul(optarg, NULL, 10) : 5;
+                if (watch_delay == 0)
+                    watch_delay = 1;
+                break;
+
+            case 'f':
+                dbfile = optarg;
+                break;
+
             case 's':
                 silent = 1;
                 break;
@@ -175,17 +607,130 @@ static void parse_command_line(int argc, char *argv[])
 
         searchdirs[nsearchdirs++] = argv[optind++];
     }
+
+    if (nsearchdirs == 0 && !resume) {
+        fprintf(stderr, "Please specify one or more directories to search\n");
+        exit(EXIT_FAILURE);
+    }
 }
 
-int callback(const char *fpath, const struct stat *sb, int typeflag __attribute__((unused)), struct FTW *ftwbuf __attribute__((unused)))
+static void load_previous(void)
+{
+    if (rehash_all)
+        return;
+
+    if ((olddb = dupdb_open(dbfile)) == NULL) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: Not a dupdb database, or wrong version. Rehashing all files.\n", dbfile);
+        else if (errno != ENOENT)
+            perror(dbfile);
+        return;
+    }
+
+    if (verbose)
+        fprintf(stderr, "Found %zu files in %s\n", dupdb_nrecords(olddb), dbfile);
+}
+
+// Returns the previous digest of fpath if the file looks unchanged.
+static const unsigned char *previous_digest(const char *fpath, const struct stat *sb)
+{
+    const struct dupdb_record *rec;
+    long idx;
+
+    if (olddb == NULL || (idx = dupdb_find_path(olddb, fpath)) == -1)
+        return NULL;
+
+    rec = dupdb_record(olddb, idx);
+    return same_stat(rec, sb) ? rec->digest : NULL;
+}
+
+static void watch_directory(const char *dir)
+{
+    static bool warned;
+
+    if (watch_add(watcher, dir) == -1 && !warned) {
+        if (errno == ENOSPC)
+            fprintf(stderr, "Too many directories to watch. Raise /proc/sys/fs/inotify/max_user_watches.\n");
+        else if (!silent)
+            perror(dir);
+        warned = true;
+    }
+}
+
+// Files to hash and digests to reuse go through the pool, so they end
+// up in the entries and the journal in the order we find them. tag is
+// the index in resumed for files from the journal, or -1 for new ones.
+static void submit(const char *fpath, const struct stat *sb, const unsigned char *digest, long tag)
+{
+    int rc;
+
+    if (digest != NULL)
+        rc = hashpool_put(pool, fpath, sb, digest, tag);
+    else
+        rc = hashpool_submit(pool, fpath, sb, tag);
+
+    if (rc == -1) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Runs on the pool's writer thread, in the order files were submitted.
+static void emit(const struct hashjob *job, void *arg __attribute__((unused)))
 {
-    int fd = -1, algo = GCRY_MD_SHA1;
-    size_t digestsize = gcry_md_get_algo_dlen(algo);
-    size_t i, stringsize = digestsize * 2 + 1;
-    char *string = NULL, *s;
-    unsigned char *digest = NULL;
-    void *contents = NULL;
     static unsigned long nfiles;
+    struct dupdb_entry *e;
+
+    if (job->err != 0) {
+        if (!silent)
+            fprintf(stderr, "%s: %s\n", job->path, strerror(job->err));
+
+        if (job->tag >= 0)
+            resumed_seen[job->tag] = false;
+        return;
+    }
+
+    // A file from the journal which changed. Update the entry, and let
+    // the journal know.
+    if (job->tag >= 0) {
+        e = &entries[resumed[job->tag].entry];
+        set_record(&e->rec, &job->sb, job->digest);
+    }
+    else {
+        // So far so good. Store path and hash somewhere suitable
+        // for sorting.
+        add_entry(job->path, &job->sb, job->digest);
+        e = &entries[nentries_used - 1];
+    }
+
+    journal_entry(e);
+    maybe_checkpoint();
+
+    if (job->hashed) {
+        counts.hashed++;
+        if (verbose)
+            fprintf(stderr, "\r%lu", ++nfiles);
+    }
+    else
+        counts.reused++;
+}
+
+static int watch_callback(const char *fpath, const struct stat *sb __attribute__((unused)),
+    int typeflag, struct FTW *ftwbuf __attribute__((unused)))
+{
+    if (typeflag == FTW_D)
+        watch_directory(fpath);
+
+    return 0;
+}
+
+int callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf __attribute__((unused)))
+{
+    const unsigned char *prev;
+    size_t i;
+
+    if (watcher != NULL && typeflag == FTW_D)
+        watch_directory(fpath);
 
     // Ignore anything but regular files
     if (!S_ISREG(sb->st_mode)) {
@@ -200,55 +745,20 @@ int callback(const char *fpath, const struct stat *sb, int typeflag __attribute_
         return 0;
     }
 
-    // Memory map the file and hash it
-    if ((fd = open(fpath, O_RDONLY)) == -1) {
-        if (!silent)
-            perror(fpath);
-        return 0;
-    }
-
-    if ((contents = mmap(NULL, sb->st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
-        close(fd);
-        if (!silent)
-            perror(fpath);
+    // Did we get this far before we were interrupted?
+    if (nresumed > 0 && (i = find_resumed(fpath)) < nresumed) {
+        resumed_seen[i] = true;
+        if (!same_stat(&resumed[i].rec, sb))
+            submit(fpath, sb, NULL, i);
         return 0;
     }
 
-    if ((digest = malloc(digestsize)) == NULL)
-        goto err;
+    if ((prev = previous_digest(fpath, sb)) != NULL)
+        submit(fpath, sb, prev, -1);
+    else
+        submit(fpath, sb, NULL, -1);
 
-    gcry_md_hash_buffer(algo, digest, contents, sb->st_size);
-
-    s = string = malloc(stringsize);
-    if (s == NULL)
-        goto err;
-
-    for (i = 0; i < digestsize; i++, s += 2)
-        sprintf(s, "%02x", digest[i]);
-
-    // So far so good. Store path and hash somewhere suitable
-    // for qsort().
-    add_entry(fpath, string);
-    if (verbose)
-        fprintf(stderr, "\r%lu", ++nfiles);
-
-    munmap(contents, sb->st_size);
-    close(fd);
-    free(digest);
     return 0;
-
-err:
-    if (contents != NULL)
-        munmap(contents, sb->st_size);
-
-    if (fd != -1)
-        close(fd);
-
-    free(digest);
-    free(string);
-
-    perror(fpath);
-    return -1;
 }
 
 
@@ -259,70 +769,424 @@ static void traverse_directories(void)
 
     assert(nsearchdirs > 0);
 
-    for (i = 0; i < nsearchdirs; i++) {
+    if ((pool = hashpool_new(nthreads, max_inflight, emit, NULL)) == NULL) {
+        perror("hashpool");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = firstdir; i < nsearchdirs; i++) {
+        curdir = i;
         if (verbose)
             fprintf(stderr, "Checking directory:%s\n", searchdirs[i]);
 
         nftw(searchdirs[i], callback, nopenfd, ftw_flags);
 
+        // Everything from this directory must be in the journal before
+        // the checkpoint says we're done with it.
+        hashpool_wait(pool);
+
         if (verbose)
             fprintf(stderr, "\n");
+
+        if (i == firstdir && resumed != NULL)
+            forget_unseen_resumed();
+
+        write_checkpoint(i + 1);
+    }
+
+    hashpool_free(pool);
+    pool = NULL;
+}
+
+static void open_journal(void)
+{
+    if ((size_t)snprintf(journalfile, sizeof journalfile, "%s.journal", dbfile) >= sizeof journalfile
+    || (size_t)snprintf(checkpointfile, sizeof checkpointfile, "%s.checkpoint", dbfile) >= sizeof checkpointfile) {
+        fprintf(stderr, "%s: File name too long\n", dbfile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (resume) {
+        load_resume_state();
+        return;
+    }
+
+    if ((journal = journal_create(journalfile)) == NULL) {
+        perror(journalfile);
+        exit(EXIT_FAILURE);
     }
+
+    write_checkpoint(0);
 }
 
-static int cmp(const void *v1, const void *v2)
+// The database is safely on disk, so we don't need these anymore.
+static void remove_journal(void)
 {
-    const struct entry *p1 = v1, *p2 = v2;
-    return strcmp(p1->hash, p2->hash);
+    journal_close(journal);
+    unlink(checkpointfile);
+    unlink(journalfile);
 }
 
-static void sort_results(void)
+// dupdb_write() sorts the entries by digest before writing them.
+static void save_results(void)
 {
     if (verbose)
-        fprintf(stderr, "Sorting %zu found files\n", nentries_used);
+        fprintf(stderr, "Sorting and saving %zu found files\n", nentries_used);
 
-    qsort(entries, nentries_used, sizeof *entries, cmp);
+    if (dupdb_write(dbfile, entries, nentries_used) == -1) {
+        perror(dbfile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Hashed %lu files, reused %lu, %lu from the journal\n",
+            counts.hashed, counts.reused, counts.resumed);
 }
 
-static void save_results(void)
+// Scan the directories and save the results, reusing digests from the
+// previous database.
+static void scan(void)
 {
-    const char *filename =".dupdb";
-    char path[4096];
+    open_journal();
+    load_previous();
+    traverse_directories();
+    save_results();
+    remove_journal();
 
-    FILE *f;
-    size_t i;
+    dupdb_close(olddb);
+    olddb = NULL;
+}
+
+static void add_dirty(const char *path, bool dir)
+{
+    struct dirty *tmp;
 
-#if 1
-    if (realpath(filename, path) == NULL) {
-        perror(filename);
+    if (ndirty == ndirty_max) {
+        ndirty_max = ndirty_max == 0 ? 1024 : ndirty_max * 2;
+        if ((tmp = realloc(dirty, ndirty_max * sizeof *dirty)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        dirty = tmp;
+    }
+
+    if ((dirty[ndirty].path = strdup(path)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-#else
-    strcpy(path, filename);
+    dirty[ndirty++].dir = dir;
+}
+
+// Directories which show up while we watch are walked right away, so we
+// can watch them too. Their files are hashed with the other dirty files.
+static int new_dir_callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf __attribute__((unused)))
+{
+    if (typeflag == FTW_D)
+        watch_directory(fpath);
+    else if (S_ISREG(sb->st_mode))
+        add_dirty(fpath, false);
+
+    return 0;
+}
+
+static void on_event(enum watch_event event, const char *path, void *arg __attribute__((unused)))
+{
+    if (debug && path != NULL)
+        fprintf(stderr, "Event %d: %s\n", (int)event, path);
+
+    switch (event) {
+        case WATCH_CHANGED:
+        case WATCH_REMOVED:
+            add_dirty(path, false);
+            break;
+
+        case WATCH_DIR_ADDED:
+            nftw(path, new_dir_callback, 12, ftw_flags);
+            break;
+
+        case WATCH_DIR_REMOVED:
+            add_dirty(path, true);
+            break;
+
+        case WATCH_OVERFLOW:
+            overflowed = true;
+            break;
+    }
+}
+
+static int cmp_dirty(const void *v1, const void *v2)
+{
+    const struct dirty *d1 = v1, *d2 = v2;
+    int rc = strcmp(d1->path, d2->path);
+
+    return rc != 0 ? rc : d1->dir - d2->dir;
+}
 
-#endif
-    if ((f = fopen(path, "w")) == NULL) {
-        perror(path);
+// Returns the first position in idx, which is sorted by path, whose
+// path isn't less than key.
+static size_t lower_bound(const size_t *idx, size_t n, const char *key)
+{
+    size_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (strcmp(entries[idx[mid]].path, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// We search the entries while we decide what to remove, so we mark
+// them first, and remove them all at the end.
+static bool *new_drop_list(void)
+{
+    bool *drop;
+
+    if ((drop = calloc(nentries_used + 1, sizeof *drop)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-    for (i = 0; i < nentries_used; i++) {
-        if (fprintf(f, "%s\t%s\n", entries[i].fpath, entries[i].hash) < 0) {
-            perror(path);
+    return drop;
+}
+
+static void drop_entries(bool *drop, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (drop[i]) {
+            free(entries[i].path);
+            entries[i].path = NULL;
+        }
+    }
+
+    free(drop);
+    compact_entries();
+}
+
+// Remove entries in directories which are gone.
+static void remove_dirty_dirs(void)
+{
+    char prefix[PATH_MAX + 1];
+    size_t i, pos, n, len, *idx;
+    bool *drop = new_drop_list();
+
+    idx = sorted_by_path(&n);
+    for (i = 0; i < ndirty; i++) {
+        if (!dirty[i].dir)
+            continue;
+
+        len = snprintf(prefix, sizeof prefix, "%s/", dirty[i].path);
+        for (pos = lower_bound(idx, n, prefix); pos < n; pos++) {
+            if (strncmp(entries[idx[pos]].path, prefix, len) != 0)
+                break;
+
+            drop[idx[pos]] = true;
+        }
+    }
+
+    free(idx);
+    drop_entries(drop, n);
+}
+
+// Runs on the pool's writer thread while we flush.
+static void flush_emit(const struct hashjob *job, void *arg)
+{
+    unsigned long *nhashed = arg;
+
+    if (job->err != 0) {
+        if (!silent)
+            fprintf(stderr, "%s: %s\n", job->path, strerror(job->err));
+        return;
+    }
+
+    if (job->tag >= 0)
+        set_record(&entries[job->tag].rec, &job->sb, job->digest);
+    else
+        add_entry(job->path, &job->sb, job->digest);
+
+    (*nhashed)++;
+}
+
+// Rehash, add or remove dirty files, and write the database again. We
+// decide what to do with each file first, as the pool's writer may move
+// the entries while we hash.
+static void flush_dirty(void)
+{
+    unsigned long nhashed = 0, nremoved = 0;
+    size_t i, pos, n, *idx;
+    struct dupdb_entry *e;
+    struct stat *sb;
+    bool *drop;
+
+    qsort(dirty, ndirty, sizeof *dirty, cmp_dirty);
+    remove_dirty_dirs();
+
+    drop = new_drop_list();
+    idx = sorted_by_path(&n);
+    for (i = 0; i < ndirty; i++) {
+        dirty[i].hash = false;
+        if (dirty[i].dir || (i > 0 && strcmp(dirty[i].path, dirty[i - 1].path) == 0 && !dirty[i - 1].dir))
+            continue;
+
+        pos = lower_bound(idx, n, dirty[i].path);
+        e = pos < n && strcmp(entries[idx[pos]].path, dirty[i].path) == 0 ? &entries[idx[pos]] : NULL;
+        sb = &dirty[i].sb;
+
+        // Gone, or not something we store?
+        if (lstat(dirty[i].path, sb) == -1 || !S_ISREG(sb->st_mode) || sb->st_size == 0) {
+            if (e != NULL) {
+                drop[e - entries] = true;
+                nremoved++;
+            }
+            continue;
+        }
+
+        if (e != NULL && same_stat(&e->rec, sb))
+            continue;
+
+        dirty[i].hash = true;
+        dirty[i].entry = e != NULL ? e - entries : -1;
+    }
+
+    free(idx);
+
+    if ((pool = hashpool_new(nthreads, max_inflight, flush_emit, &nhashed)) == NULL) {
+        perror("hashpool");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < ndirty; i++) {
+        if (dirty[i].hash && hashpool_submit(pool, dirty[i].path, &dirty[i].sb, dirty[i].entry) == -1) {
+            fprintf(stderr, "Out of memory\n");
             exit(EXIT_FAILURE);
         }
     }
 
-    fclose(f);
+    hashpool_free(pool);
+    pool = NULL;
+    drop_entries(drop, n);
+
+    for (i = 0; i < ndirty; i++)
+        free(dirty[i].path);
+    ndirty = 0;
+
+    if (dupdb_write(dbfile, entries, nentries_used) == -1) {
+        perror(dbfile);
+        exit(EXIT_FAILURE);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Updated %s: %lu files hashed, %lu removed, %zu in total\n",
+            dbfile, nhashed, nremoved, nentries_used);
+}
+
+// Events were lost, so we don't know what changed. We scan everything
+// again, but files which haven't changed keep their digests.
+static void rescan(void)
+{
+    size_t i;
+
+    if (verbose)
+        fprintf(stderr, "Lost track of changes. Scanning again.\n");
+
+    for (i = 0; i < ndirty; i++)
+        free(dirty[i].path);
+    ndirty = 0;
+
+    for (i = 0; i < nentries_used; i++)
+        free(entries[i].path);
+    nentries_used = 0;
+
+    overflowed = false;
+    scan();
+}
+
+static void on_signal(int sig __attribute__((unused)))
+{
+    stop = 1;
+}
+
+// Wait for changes until we're told to stop. If changes keep coming,
+// we don't wait for a quiet moment for more than ten periods.
+static void watch_loop(void)
+{
+    struct sigaction sa;
+    time_t first_dirty = 0;
+    int rc;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (verbose)
+        fprintf(stderr, "Watching for changes\n");
+
+    while (!stop) {
+        rc = watch_read(watcher, ndirty > 0 ? (int)watch_delay * 1000 : -1, on_event, NULL);
+        if (rc == -1 && errno != EINTR) {
+            perror("inotify");
+            exit(EXIT_FAILURE);
+        }
+
+        if (overflowed)
+            rescan();
+
+        if (ndirty > 0 && first_dirty == 0)
+            first_dirty = time(NULL);
+
+        if (ndirty > 0 && (rc == 0 || stop || time(NULL) - first_dirty >= 10 * (time_t)watch_delay)) {
+            flush_dirty();
+            first_dirty = 0;
+        }
+    }
 }
 
 int main(int argc, char *argv[])
 {
+    size_t i;
+
     parse_command_line(argc, argv);
-    traverse_directories();
-    sort_results();
 
-    save_results();
+    // libgcrypt wants this before it's used from several threads.
+    if (gcry_check_version(GCRYPT_VERSION) == NULL) {
+        fprintf(stderr, "libgcrypt is older than the version we were built with\n");
+        exit(EXIT_FAILURE);
+    }
+    gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+    if (nthreads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? n : 1;
+    }
+
+    // We watch directories as we find them, so we won't miss changes
+    // made while we scan.
+    if (watch_delay > 0 && (watcher = watch_open()) == NULL) {
+        perror("inotify");
+        exit(EXIT_FAILURE);
+    }
+
+    scan();
+
+    if (watcher != NULL) {
+        // A resumed scan skips the directories done before we were
+        // interrupted, so nothing watches them yet.
+        for (i = 0; i < firstdir; i++)
+            nftw(searchdirs[i], watch_callback, 12, ftw_flags);
+
+        // The first scan may have been resumed. Later ones aren't.
+        forget_resume_state();
+        watch_loop();
+        watch_close(watcher);
+    }
+
     return 0;
 }
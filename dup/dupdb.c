@@ -0,0 +1,524 @@
+#include "dupdb.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct dupdb {
+    void *map;
+    size_t mapsize;
+    const struct dupdb_header *header;
+    const struct dupdb_record *records;
+    const uint64_t *pathindex;
+    const uint64_t *blockindex;
+    const unsigned char *strings;
+    size_t nblocks;
+};
+
+static int cmp_entry(const void *v1, const void *v2)
+{
+    const struct dupdb_entry *p1 = v1, *p2 = v2;
+    int rc = memcmp(p1->rec.digest, p2->rec.digest, DUPDB_DIGEST_SIZE);
+
+    return rc != 0 ? rc : strcmp(p1->path, p2->path);
+}
+
+static int cmp_path(const void *v1, const void *v2, void *arg)
+{
+    const uint64_t *i1 = v1, *i2 = v2;
+    const struct dupdb_entry *entries = arg;
+
+    return strcmp(entries[*i1].path, entries[*i2].path);
+}
+
+static int put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        if (putc((v & 0x7f) | 0x80, f) == EOF)
+            return -1;
+        v >>= 7;
+    }
+
+    return putc(v, f) == EOF ? -1 : 0;
+}
+
+static size_t varint_size(uint64_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+// Write the front coded path table, and remember where each block starts.
+static int write_paths(FILE *f, const struct dupdb_entry *entries, const uint64_t *pathindex,
+    size_t n, uint64_t *blockindex, uint64_t *size)
+{
+    const char *path, *prev = NULL;
+    size_t i, len, shared;
+
+    *size = 0;
+    for (i = 0; i < n; i++) {
+        path = entries[pathindex[i]].path;
+        len = strlen(path);
+
+        if (i % DUPDB_BLOCK_SIZE == 0) {
+            blockindex[i / DUPDB_BLOCK_SIZE] = *size;
+            shared = 0;
+        }
+        else {
+            for (shared = 0; path[shared] != '\0' && path[shared] == prev[shared]; shared++)
+                ;
+
+            if (put_varint(f, shared) == -1)
+                return -1;
+            *size += varint_size(shared);
+        }
+
+        if (put_varint(f, len - shared) == -1 || fwrite(path + shared, 1, len - shared, f) != len - shared)
+            return -1;
+
+        *size += varint_size(len - shared) + len - shared;
+        prev = path;
+    }
+
+    return 0;
+}
+
+static int write_all(FILE *f, struct dupdb_entry *entries, size_t n)
+{
+    struct dupdb_header h;
+    struct dupdb_record rec;
+    uint64_t *pathindex, *pathid, *blockindex;
+    size_t i, nblocks = (n + DUPDB_BLOCK_SIZE - 1) / DUPDB_BLOCK_SIZE;
+    int rc = -1;
+
+    for (i = 0; i < n; i++) {
+        if (strlen(entries[i].path) >= DUPDB_PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+    }
+
+    pathindex = malloc((n + 1) * sizeof *pathindex);
+    pathid = malloc((n + 1) * sizeof *pathid);
+    blockindex = malloc((nblocks + 1) * sizeof *blockindex);
+    if (pathindex == NULL || pathid == NULL || blockindex == NULL)
+        goto out;
+
+    for (i = 0; i < n; i++)
+        pathindex[i] = i;
+
+    qsort_r(pathindex, n, sizeof *pathindex, cmp_path, entries);
+    for (i = 0; i < n; i++)
+        pathid[pathindex[i]] = i;
+
+    // We don't know the size of the path table until we've written it,
+    // so we write the header last.
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, DUPDB_MAGIC, sizeof h.magic);
+    h.version = DUPDB_VERSION;
+    h.record_size = sizeof rec;
+    h.block_size = DUPDB_BLOCK_SIZE;
+    h.nrecords = n;
+    h.records_offset = sizeof h;
+    h.pathindex_offset = h.records_offset + n * sizeof rec;
+    h.strings_offset = h.pathindex_offset + n * sizeof *pathindex;
+
+    if (fwrite(&h, sizeof h, 1, f) != 1)
+        goto out;
+
+    for (i = 0; i < n; i++) {
+        rec = entries[i].rec;
+        rec.path_id = pathid[i];
+
+        if (fwrite(&rec, sizeof rec, 1, f) != 1)
+            goto out;
+    }
+
+    if (fwrite(pathindex, sizeof *pathindex, n, f) != n
+    || write_paths(f, entries, pathindex, n, blockindex, &h.strings_size) == -1)
+        goto out;
+
+    // Align the block index
+    h.blockindex_offset = (h.strings_offset + h.strings_size + 7) & ~(uint64_t)7;
+    for (i = h.strings_offset + h.strings_size; i < h.blockindex_offset; i++) {
+        if (putc('\0', f) == EOF)
+            goto out;
+    }
+
+    if (fwrite(blockindex, sizeof *blockindex, nblocks, f) != nblocks
+    || fseek(f, 0, SEEK_SET) == -1
+    || fwrite(&h, sizeof h, 1, f) != 1)
+        goto out;
+
+    rc = 0;
+
+out:
+    free(pathindex);
+    free(pathid);
+    free(blockindex);
+    return rc;
+}
+
+int dupdb_write(const char *filename, struct dupdb_entry *entries, size_t n)
+{
+    char tmpname[PATH_MAX];
+    FILE *f;
+    int fd, err;
+
+    assert(filename != NULL);
+    assert(entries != NULL || n == 0);
+
+    qsort(entries, n, sizeof *entries, cmp_entry);
+
+    if ((size_t)snprintf(tmpname, sizeof tmpname, "%s.XXXXXX", filename) >= sizeof tmpname) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if ((fd = mkstemp(tmpname)) == -1)
+        return -1;
+
+    if ((f = fdopen(fd, "w")) == NULL) {
+        err = errno;
+        close(fd);
+        goto err;
+    }
+
+    setvbuf(f, NULL, _IOFBF, 1024 * 1024);
+    if (write_all(f, entries, n) == -1 || fflush(f) == EOF || fsync(fileno(f)) == -1) {
+        err = errno;
+        fclose(f);
+        goto err;
+    }
+
+    if (fchmod(fileno(f), 0644) == -1 || fclose(f) == EOF) {
+        err = errno;
+        goto err;
+    }
+
+    if (rename(tmpname, filename) == -1) {
+        err = errno;
+        goto err;
+    }
+
+    return 0;
+
+err:
+    unlink(tmpname);
+    errno = err;
+    return -1;
+}
+
+static int valid(const struct dupdb *db)
+{
+    const struct dupdb_header *h = db->header;
+
+    if (db->mapsize < sizeof *h
+    || memcmp(h->magic, DUPDB_MAGIC, sizeof h->magic) != 0
+    || h->version != DUPDB_VERSION
+    || h->record_size != sizeof(struct dupdb_record))
+        return 0;
+
+    if (h->block_size == 0
+    || h->records_offset > db->mapsize
+    || h->nrecords > (db->mapsize - h->records_offset) / sizeof(struct dupdb_record)
+    || h->pathindex_offset > db->mapsize
+    || h->nrecords > (db->mapsize - h->pathindex_offset) / sizeof(uint64_t)
+    || h->strings_offset > db->mapsize
+    || h->strings_size > db->mapsize - h->strings_offset
+    || h->blockindex_offset > db->mapsize
+    || (h->nrecords + h->block_size - 1) / h->block_size > (db->mapsize - h->blockindex_offset) / sizeof(uint64_t))
+        return 0;
+
+    return 1;
+}
+
+struct dupdb *dupdb_open(const char *filename)
+{
+    struct dupdb *db;
+    struct stat st;
+    int fd, err;
+
+    assert(filename != NULL);
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return NULL;
+
+    if (fstat(fd, &st) == -1 || (db = calloc(1, sizeof *db)) == NULL) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    db->mapsize = st.st_size;
+    if (db->mapsize < sizeof *db->header) {
+        close(fd);
+        free(db);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    db->map = mmap(NULL, db->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (db->map == MAP_FAILED) {
+        free(db);
+        errno = err;
+        return NULL;
+    }
+
+    db->header = db->map;
+    db->records = (const void *)((const char *)db->map + db->header->records_offset);
+    db->pathindex = (const void *)((const char *)db->map + db->header->pathindex_offset);
+    db->blockindex = (const void *)((const char *)db->map + db->header->blockindex_offset);
+    db->strings = (const unsigned char *)db->map + db->header->strings_offset;
+
+    if (!valid(db)) {
+        dupdb_close(db);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    db->nblocks = (db->header->nrecords + db->header->block_size - 1) / db->header->block_size;
+
+    return db;
+}
+
+void dupdb_close(struct dupdb *db)
+{
+    if (db != NULL) {
+        munmap(db->map, db->mapsize);
+        free(db);
+    }
+}
+
+size_t dupdb_nrecords(const struct dupdb *db)
+{
+    assert(db != NULL);
+    return db->header->nrecords;
+}
+
+const struct dupdb_record *dupdb_record(const struct dupdb *db, size_t idx)
+{
+    assert(db != NULL);
+    assert(idx < db->header->nrecords);
+    return &db->records[idx];
+}
+
+// Reads a varint at *pos, or returns -1 if it'd take us past end.
+static int get_varint(const unsigned char *p, size_t *pos, size_t end, uint64_t *v)
+{
+    unsigned shift = 0;
+
+    *v = 0;
+    while (*pos < end && shift < 64) {
+        *v |= (uint64_t)(p[*pos] & 0x7f) << shift;
+        if ((p[(*pos)++] & 0x80) == 0)
+            return 0;
+        shift += 7;
+    }
+
+    return -1;
+}
+
+// Decode paths in a block, one by one. A corrupt block gives empty paths.
+struct block_reader {
+    const struct dupdb *db;
+    size_t pos, end;   // Offsets in the path table
+    size_t id, last;   // Path ids. last is one past the block's last path.
+    char *buf;
+};
+
+static void block_begin(struct block_reader *r, const struct dupdb *db, size_t block, char *buf)
+{
+    r->db = db;
+    r->id = block * db->header->block_size;
+    r->last = r->id + db->header->block_size;
+    if (r->last > db->header->nrecords)
+        r->last = db->header->nrecords;
+
+    r->end = db->header->strings_size;
+    r->pos = db->blockindex[block];
+    if (r->pos > r->end)
+        r->pos = r->end;
+
+    r->buf = buf;
+    buf[0] = '\0';
+}
+
+// Decode the next path into r->buf. Returns 0 at the end of the block.
+static int block_next(struct block_reader *r)
+{
+    uint64_t shared = 0, len;
+
+    if (r->id == r->last)
+        return 0;
+
+    if (r->id % r->db->header->block_size != 0 && get_varint(r->db->strings, &r->pos, r->end, &shared) == -1)
+        shared = len = 0;
+    else if (get_varint(r->db->strings, &r->pos, r->end, &len) == -1)
+        shared = len = 0;
+
+    if (shared > strlen(r->buf) || shared + len >= DUPDB_PATH_MAX || len > r->end - r->pos)
+        shared = len = 0;
+
+    memcpy(r->buf + shared, r->db->strings + r->pos, len);
+    r->buf[shared + len] = '\0';
+    r->pos += len;
+    r->id++;
+    return 1;
+}
+
+// Decode the path with the given id into buf.
+static const char *path_by_id(const struct dupdb *db, size_t id, char *buf)
+{
+    struct block_reader r;
+
+    block_begin(&r, db, id / db->header->block_size, buf);
+    while (r.id <= id && block_next(&r))
+        ;
+
+    return buf;
+}
+
+const char *dupdb_path(const struct dupdb *db, size_t idx, char buf[DUPDB_PATH_MAX])
+{
+    assert(db != NULL);
+    assert(idx < db->header->nrecords);
+    assert(buf != NULL);
+
+    if (db->records[idx].path_id >= db->header->nrecords) {
+        buf[0] = '\0';
+        return buf;
+    }
+
+    return path_by_id(db, db->records[idx].path_id, buf);
+}
+
+size_t dupdb_bypath(const struct dupdb *db, size_t pos)
+{
+    uint64_t idx;
+
+    assert(db != NULL);
+    assert(pos < db->header->nrecords);
+
+    // We don't verify the whole index when opening, as that'd make
+    // every lookup linear. A corrupt index gives wrong answers, not crashes.
+    idx = db->pathindex[pos];
+    return idx < db->header->nrecords ? idx : 0;
+}
+
+// Returns the first record whose digest isn't less than digest,
+// or the first which is greater if upper is set.
+static size_t digest_bound(const struct dupdb *db, const unsigned char *digest, int upper)
+{
+    size_t lo = 0, hi = db->header->nrecords, mid;
+    int rc;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rc = memcmp(db->records[mid].digest, digest, DUPDB_DIGEST_SIZE);
+        if (rc < 0 || (upper && rc == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+size_t dupdb_find_digest(const struct dupdb *db, const unsigned char *digest, size_t *first)
+{
+    assert(db != NULL);
+    assert(digest != NULL);
+    assert(first != NULL);
+
+    *first = digest_bound(db, digest, 0);
+    return digest_bound(db, digest, 1) - *first;
+}
+
+// Compare a path to the key, looking at no more than len bytes.
+static int cmp_key(const char *path, const char *key, size_t len, int upper)
+{
+    int rc = strncmp(path, key, len);
+    return upper ? rc > 0 : rc >= 0;
+}
+
+// Like digest_bound(), but for the path table. We compare at most len
+// bytes, and len is SIZE_MAX for whole paths. First we do a binary search
+// on the first path of each block, as that path is stored as is. Then we
+// decode the block before the one we found.
+static size_t path_bound(const struct dupdb *db, const char *key, size_t len, int upper)
+{
+    char buf[DUPDB_PATH_MAX];
+    struct block_reader r;
+    size_t lo = 0, hi = db->nblocks, mid;
+
+    // Find the first block whose first path is past key.
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        block_begin(&r, db, mid, buf);
+        block_next(&r);
+        if (cmp_key(buf, key, len, upper))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    if (lo == 0)
+        return 0;
+
+    block_begin(&r, db, lo - 1, buf);
+    while (block_next(&r)) {
+        if (cmp_key(buf, key, len, upper))
+            return r.id - 1;
+    }
+
+    return r.last;
+}
+
+long dupdb_find_path(const struct dupdb *db, const char *path)
+{
+    char buf[DUPDB_PATH_MAX];
+    size_t pos, idx;
+
+    assert(db != NULL);
+    assert(path != NULL);
+
+    pos = path_bound(db, path, SIZE_MAX, 0);
+    if (pos == db->header->nrecords)
+        return -1;
+
+    idx = dupdb_bypath(db, pos);
+    return strcmp(path_by_id(db, pos, buf), path) == 0 ? (long)idx : -1;
+}
+
+size_t dupdb_find_prefix(const struct dupdb *db, const char *prefix, size_t *first)
+{
+    size_t len;
+
+    assert(db != NULL);
+    assert(prefix != NULL);
+    assert(first != NULL);
+
+    len = strlen(prefix);
+    *first = path_bound(db, prefix, len, 0);
+    return path_bound(db, prefix, len, 1) - *first;
+}
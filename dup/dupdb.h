@@ -0,0 +1,99 @@
+#ifndef DUPDB_H
+#define DUPDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The .dupdb file written by dupdate and read by dupfind.
+ *
+ * Layout:
+ *   struct dupdb_header
+ *   struct dupdb_record[nrecords], sorted by digest, then path
+ *   uint64_t[nrecords], record indexes sorted by path
+ *   path table, sorted by path, in blocks of block_size paths
+ *   uint64_t[nblocks], offset of each block in the path table
+ *
+ * Most paths share a long prefix with the previous one, so the path table
+ * is front coded. The first path of a block is stored as a varint length
+ * and the bytes. The others are stored as a varint length of the prefix
+ * shared with the previous path, a varint length of the rest, and the
+ * rest. Paths aren't NUL-terminated. A record refers to its path by its
+ * position in the path table, which is also its position in the path
+ * index. To get a path, we decode at most one block.
+ *
+ * All numbers are in native byte order. A database from a host with
+ * different endianness has the wrong version number, and is rejected.
+ * The file is meant to be mmap()ed and used as is, so records are
+ * fixed size and aligned.
+ */
+#define DUPDB_MAGIC "DUPDB\0\0\0"
+#define DUPDB_VERSION 3
+#define DUPDB_DIGEST_SIZE 20 /* SHA1 */
+#define DUPDB_BLOCK_SIZE 16 /* Paths per block */
+#define DUPDB_PATH_MAX 4096 /* Including the NUL */
+
+struct dupdb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t nrecords;
+    uint64_t records_offset;
+    uint64_t strings_offset;   /* The path table */
+    uint64_t strings_size;
+    uint64_t pathindex_offset;
+    uint64_t blockindex_offset;
+    uint32_t block_size;
+    uint32_t reserved;
+};
+
+struct dupdb_record {
+    unsigned char digest[DUPDB_DIGEST_SIZE];
+    uint32_t mtime_nsec;
+    uint64_t path_id; /* Position in the path table */
+    uint64_t size;
+    int64_t mtime_sec;
+    uint64_t dev;
+    uint64_t ino;
+};
+
+/* What dupdate collects, and hands to dupdb_write(). */
+struct dupdb_entry {
+    char *path;
+    struct dupdb_record rec;
+};
+
+/* Sort entries by digest and path, and write them to filename. We write
+ * to a temporary file first and rename it, so readers see either the
+ * old or the new database. Returns 0 on success, -1 with errno set.
+ * errno is ENAMETOOLONG if a path doesn't fit in DUPDB_PATH_MAX. */
+int dupdb_write(const char *filename, struct dupdb_entry *entries, size_t n);
+
+/* An open, mmap()ed database. */
+struct dupdb;
+
+/* Returns NULL with errno set on errors. errno is EINVAL if the file
+ * isn't a database we understand. */
+struct dupdb *dupdb_open(const char *filename);
+void dupdb_close(struct dupdb *db);
+
+size_t dupdb_nrecords(const struct dupdb *db);
+const struct dupdb_record *dupdb_record(const struct dupdb *db, size_t idx);
+
+/* Decode the path of record idx into buf, and return buf. */
+const char *dupdb_path(const struct dupdb *db, size_t idx, char buf[DUPDB_PATH_MAX]);
+
+/* Lookups are binary searches. The ones returning a count also return
+ * the first matching position in *first. */
+
+/* Records with the given digest are at [*first, *first + count). */
+size_t dupdb_find_digest(const struct dupdb *db, const unsigned char *digest, size_t *first);
+
+/* Returns the record index of path, or -1 if it's not in the database. */
+long dupdb_find_path(const struct dupdb *db, const char *path);
+
+/* Paths starting with prefix are at positions [*first, *first + count)
+ * of the path index. Use dupdb_bypath() to get their record indexes. */
+size_t dupdb_find_prefix(const struct dupdb *db, const char *prefix, size_t *first);
+size_t dupdb_bypath(const struct dupdb *db, size_t pos);
+
+#endif
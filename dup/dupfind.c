@@ -5,7 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ftw.h>
+#include <errno.h>
 #include <gcrypt.h>
 
 #include <sys/mman.h>
@@ -14,66 +14,41 @@
 #include <fcntl.h>
 #include <unistd.h>
 
-int ftw_flags = FTW_ACTIONRETVAL | FTW_STOP | FTW_PHYS;
+#include "dupdb.h"
+
 int verbose = 0;
 int debug = 0;
+const char *dbfile = ".dupdb";
 
-// We store paths and hash values in structs like this:
-struct entry {
-    char *fpath;
-    char *hash;
-};
-struct entry *entries = NULL;
-size_t nentries_max = 0; // How many have we allocated room for?
-size_t nentries_used = 0; // How many has been used?
-
-size_t initial_nentries = 300000; // We start off supporting that many entries
-
-static void add_entry(const char *fpath, const char *hash)
-{
-    if (nentries_max == 0) {
-        // first entry.
-        if ((entries = malloc(sizeof *entries * initial_nentries)) == NULL) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-
-        nentries_max = initial_nentries;
-    }
-    else if (nentries_used == nentries_max) {
-        // reallocate
-        struct entry *tmp;
-        size_t new_size = nentries_max * 2 * sizeof *entries;
-
-        if ((tmp = realloc(entries, new_size)) == NULL) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-        entries = tmp;
-        nentries_max *= 2;
-    }
-
-    // Add element. 
-    if ((entries[nentries_used].fpath = strdup(fpath)) == NULL) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
-
-    if ((entries[nentries_used++].hash = strdup(hash)) == NULL) {
-        fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
-    }
-}
+// With -j, we join several databases on digest. See join().
+enum join { JOIN_NONE, JOIN_INTERSECT, JOIN_DIFFERENCE, JOIN_UNION } join_mode = JOIN_NONE;
+const char *dbfiles[64];
+size_t ndbfiles = 0;
+const char *prefix = NULL; // Only report duplicates with a member under this path
+int grouped = 0; // Print each set of duplicates once, with its size
 
 static void show_usage(void)
 {
     static const char *text[] = {
-        "USAGE: find_duplicate_files [options] directory...",
+        "USAGE: dupfind [options] [file...]",
         "",
-        "The program will locate ALL files in the directories specified.",
-        "Then it will compare the contents and report paths to duplicates.",
+        "The program reads the database written by dupdate",
+        "and reports paths to duplicates. If files are given, we hash them",
+        "and report their duplicates in the database. The files don't",
+        "have to be in the database.",
         "",
         "options",
+        "-f file Database file. Default is .dupdb. Use -f once per",
+        "   database with -j.",
+        "-j mode Join the databases on content. mode is one of",
+        "   intersect  Content found in all databases",
+        "   difference Content in the first database, but in none of the others",
+        "   union      Content found more than once, in any of the databases",
+        "   Output is grouped, with the database name before each path.",
+        "-p path Only report duplicates with at least one file under path.",
+        "   The path must be given the way dupdate saw it, e.g., relative",
+        "   to the directory dupdate ran in.",
+        "-g Print each set of duplicates once, with the file size.",
         "-v Verbose. Print info as we progress.",
         "-d debug. Print misc debugging info.",
         "",
@@ -90,7 +65,7 @@ static void parse_command_line(int argc, char *argv[])
     extern char *optarg;
     extern int optind;
 
-    const char *options = "vhd";
+    const char *options = "vhdf:p:gj:";
 
     while ((c = getopt(argc, argv, options)) != -1) {
         switch (c) {
@@ -102,6 +77,36 @@ static void parse_command_line(int argc, char *argv[])
                 debug = 1;
                 break;
 
+            case 'f':
+                if (ndbfiles == sizeof dbfiles / sizeof *dbfiles) {
+                    fprintf(stderr, "error: too many databases specified.\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                dbfile = dbfiles[ndbfiles++] = optarg;
+                break;
+
+            case 'j':
+                if (strcmp(optarg, "intersect") == 0)
+                    join_mode = JOIN_INTERSECT;
+                else if (strcmp(optarg, "difference") == 0)
+                    join_mode = JOIN_DIFFERENCE;
+                else if (strcmp(optarg, "union") == 0)
+                    join_mode = JOIN_UNION;
+                else {
+                    fprintf(stderr, "Unknown join mode %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'p':
+                prefix = optarg;
+                break;
+
+            case 'g':
+                grouped = 1;
+                break;
+
             case 'v':
                 verbose = 1;
                 break;
@@ -112,45 +117,313 @@ static void parse_command_line(int argc, char *argv[])
                 exit(EXIT_FAILURE);
         }
     }
+
+    if (ndbfiles > 1 && join_mode == JOIN_NONE) {
+        fprintf(stderr, "Use -j to tell how to combine the databases\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (join_mode != JOIN_NONE && (optind < argc || prefix != NULL)) {
+        fprintf(stderr, "-j can't be combined with -p or files\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ndbfiles == 0)
+        dbfiles[ndbfiles++] = dbfile;
 }
 
-static void read_results(void)
+static struct dupdb *open_db(const char *filename)
 {
-    const char *filename =".dupdb";
-    FILE *f;
-    char fpath[20000], hash[1000];
+    struct dupdb *db;
 
-    if ((f = fopen(filename, "r")) == NULL) {
-        perror(filename);
+    if ((db = dupdb_open(filename)) == NULL) {
+        if (errno == EINVAL)
+            fprintf(stderr, "%s: Not a dupdb database, or wrong version. Run dupdate again.\n", filename);
+        else
+            perror(filename);
         exit(EXIT_FAILURE);
     }
 
-    while (fscanf(f, "%[^\t]\t%[^\n]\n", fpath, hash) == 2) {
-        add_entry(fpath, hash);
+    return db;
+}
+
+// Print the records [first, first + n), which all have the same digest.
+// file is a file which isn't necessarily in the database, or NULL.
+static void print_group(const struct dupdb *db, size_t first, size_t n, const char *file)
+{
+    char path[DUPDB_PATH_MAX], prev[DUPDB_PATH_MAX];
+    size_t i;
+
+    if (grouped) {
+        printf("# %llu bytes\n", (unsigned long long)dupdb_record(db, first)->size);
+        if (file != NULL)
+            printf("'%s'\n", file);
+
+        for (i = first; i < first + n; i++) {
+            if (file == NULL || strcmp(file, dupdb_path(db, i, path)) != 0)
+                printf("'%s'\n", dupdb_path(db, i, path));
+        }
+
+        printf("\n");
+        return;
+    }
+
+    for (i = first; i < first + n; i++) {
+        dupdb_path(db, i, path);
+        if (file == NULL && i > first)
+            printf("'%s'\t'%s'\n", prev, path);
+        else if (file != NULL && strcmp(file, path) != 0)
+            printf("'%s'\t'%s'\n", file, path);
+
+        strcpy(prev, path);
+    }
+}
+
+// The records are sorted by digest, so we can traverse them
+// to locate duplicates.
+static void find_all(const struct dupdb *db)
+{
+    size_t i, first, n = dupdb_nrecords(db);
+
+    for (first = 0; first < n; first = i) {
+        for (i = first + 1; i < n; i++) {
+            if (memcmp(dupdb_record(db, first)->digest, dupdb_record(db, i)->digest, DUPDB_DIGEST_SIZE) != 0)
+                break;
+        }
+
+        if (i - first > 1)
+            print_group(db, first, i - first, NULL);
     }
+}
 
-    fclose(f);
+// Is path equal to prefix, or in a directory below it?
+static int under_prefix(const char *path, size_t len)
+{
+    return strncmp(path, prefix, len) == 0
+        && (len == 0 || prefix[len - 1] == '/' || path[len] == '\0' || path[len] == '/');
+}
+
+// Look up the paths starting with prefix in the path index, then look
+// up their digests. A set of duplicates may have many members under
+// prefix, and we print it for the first one we meet. The paths come in
+// path order, not digest order, so we remember which sets we printed by
+// the index of their first record.
+static void find_under_prefix(const struct dupdb *db)
+{
+    size_t pos, first, n, idx, gfirst, gn, len = strlen(prefix);
+    char path[DUPDB_PATH_MAX];
+    unsigned char *printed;
+
+    if ((printed = calloc(dupdb_nrecords(db) / 8 + 1, 1)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    n = dupdb_find_prefix(db, prefix, &first);
+    for (pos = first; pos < first + n; pos++) {
+        idx = dupdb_bypath(db, pos);
+        if (!under_prefix(dupdb_path(db, idx, path), len))
+            continue;
+
+        gn = dupdb_find_digest(db, dupdb_record(db, idx)->digest, &gfirst);
+        if (gn < 2 || printed[gfirst / 8] & (1 << gfirst % 8))
+            continue;
+
+        printed[gfirst / 8] |= 1 << gfirst % 8;
+        print_group(db, gfirst, gn, NULL);
+    }
+
+    free(printed);
+}
+
+// Memory map the file and hash it, like dupdate does.
+static int hash_file(const char *file, unsigned char *digest, uint64_t *size)
+{
+    struct stat sb;
+    void *contents;
+    int fd;
+
+    if ((fd = open(file, O_RDONLY)) == -1)
+        return -1;
+
+    if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    if ((contents = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    gcry_md_hash_buffer(GCRY_MD_SHA1, digest, contents, sb.st_size);
+    munmap(contents, sb.st_size);
+    close(fd);
+    *size = sb.st_size;
+    return 1;
+}
+
+static void find_file(const struct dupdb *db, const char *file)
+{
+    unsigned char digest[DUPDB_DIGEST_SIZE];
+    char path[DUPDB_PATH_MAX];
+    size_t first, n;
+    uint64_t size;
+    int rc;
+
+    assert(gcry_md_get_algo_dlen(GCRY_MD_SHA1) == sizeof digest);
+
+    if ((rc = hash_file(file, digest, &size)) == -1) {
+        perror(file);
+        return;
+    }
+
+    // dupdate skips empty files and non-regular files, and so do we.
+    if (rc == 0) {
+        if (verbose)
+            fprintf(stderr, "Skipping %s. Not a regular file, or empty.\n", file);
+        return;
+    }
+
+    n = dupdb_find_digest(db, digest, &first);
+    if (debug)
+        fprintf(stderr, "%s: %zu matches\n", file, n);
+
+    // A match with a different size is a SHA1 collision, or more likely,
+    // a stale database. Either way, it's not a duplicate.
+    if (n > 0 && dupdb_record(db, first)->size != size)
+        return;
+
+    if (n > 1 || (n == 1 && strcmp(file, dupdb_path(db, first, path)) != 0))
+        print_group(db, first, n, file);
+}
+
+// A position in one of the databases we join. The records in
+// [pos, end) have the digest we're currently looking at.
+struct cursor {
+    const char *name;
+    struct dupdb *db;
+    size_t pos, end, n;
+};
+
+static const unsigned char *cursor_digest(const struct cursor *c)
+{
+    return c->pos < c->n ? dupdb_record(c->db, c->pos)->digest : NULL;
+}
+
+static void print_run(const struct cursor *c)
+{
+    char path[DUPDB_PATH_MAX];
+    size_t i;
+
+    for (i = c->pos; i < c->end; i++)
+        printf("%s\t'%s'\n", c->name, dupdb_path(c->db, i, path));
+}
+
+// Streaming k-way merge-join on digest. The databases are sorted by
+// digest, so we repeatedly pick the smallest digest among the cursors,
+// find the run of records with that digest in each database, decide
+// whether the mode wants it, and move past it. We never hold more than
+// a cursor per database, whatever the size of the databases. k is
+// small, so we find the smallest digest with a linear scan.
+static void join(struct cursor *cursors, size_t k)
+{
+    const unsigned char *min, *d;
+    size_t i, nhits, nrecords, first;
+    int print;
+
+    for (;;) {
+        min = NULL;
+        for (i = 0; i < k; i++) {
+            if ((d = cursor_digest(&cursors[i])) != NULL
+            && (min == NULL || memcmp(d, min, DUPDB_DIGEST_SIZE) < 0))
+                min = d;
+        }
+
+        if (min == NULL)
+            break;
+
+        // Find the run in each database. Runs are short, so we scan.
+        nhits = nrecords = 0;
+        first = k;
+        for (i = 0; i < k; i++) {
+            struct cursor *c = &cursors[i];
+
+            c->end = c->pos;
+            while (c->end < c->n && memcmp(dupdb_record(c->db, c->end)->digest, min, DUPDB_DIGEST_SIZE) == 0)
+                c->end++;
+
+            if (c->end > c->pos) {
+                nhits++;
+                nrecords += c->end - c->pos;
+                if (first == k)
+                    first = i;
+            }
+        }
+
+        switch (join_mode) {
+            case JOIN_INTERSECT:
+                print = nhits == k;
+                break;
+
+            case JOIN_DIFFERENCE:
+                print = nhits == 1 && cursors[0].end > cursors[0].pos;
+                break;
+
+            case JOIN_UNION:
+            default:
+                print = nrecords > 1;
+                break;
+        }
+
+        if (print) {
+            printf("# %llu bytes\n", (unsigned long long)dupdb_record(cursors[first].db, cursors[first].pos)->size);
+            for (i = 0; i < k; i++)
+                print_run(&cursors[i]);
+            printf("\n");
+        }
+
+        for (i = 0; i < k; i++)
+            cursors[i].pos = cursors[i].end;
+    }
 }
 
 int main(int argc, char *argv[])
 {
+    struct cursor cursors[sizeof dbfiles / sizeof *dbfiles];
+    struct dupdb *db;
     size_t i;
 
     parse_command_line(argc, argv);
 
-    read_results();
+    if (join_mode != JOIN_NONE) {
+        for (i = 0; i < ndbfiles; i++) {
+            cursors[i].name = dbfiles[i];
+            cursors[i].db = open_db(dbfiles[i]);
+            cursors[i].pos = cursors[i].end = 0;
+            cursors[i].n = dupdb_nrecords(cursors[i].db);
+        }
+
+        join(cursors, ndbfiles);
+
+        for (i = 0; i < ndbfiles; i++)
+            dupdb_close(cursors[i].db);
+
+        return 0;
+    }
+
+    db = open_db(dbfile);
 
-    // Assuming that we got this far, now what?
-    // entries is now sorted by hash, so we can traverse it
-    // to locate duplicates.
-    for (i = 1; i < nentries_used; i++) {
-        if (strcmp(entries[i - 1].hash, entries[i].hash) == 0)
-            printf("'%s'\t'%s'\n", entries[i - 1].fpath, entries[i].fpath);
+    if (optind < argc) {
+        while (optind < argc)
+            find_file(db, argv[optind++]);
     }
+    else if (prefix != NULL)
+        find_under_prefix(db);
+    else
+        find_all(db);
 
-    // TODO: We probably want to be smarter about our output. 
-    // Today's version is a PITA to read since a hash is printed at least twice.
-    // It's just confusing. Some kind of UI would be nice too,
+    // TODO: Some kind of UI would be nice,
     // if it helps us with deleting duplicates. GUI or TUI? 
     // curses or Qt/glade/glib?
     //
@@ -163,5 +436,6 @@ int main(int argc, char *argv[])
     // we want to be sure that we get things in the right order and not
     // mix masterdir with copydir.
 
+    dupdb_close(db);
     return 0;
 }
@@ -0,0 +1,303 @@
+#include "hashpool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Jobs live in a ring, indexed by sequence number. The submitter fills
+// slots, the workers hash them, and the writer empties them in order.
+// A slow file holds up the writer, but not the workers, until the ring
+// is full.
+#define RING_SIZE 4096
+#define CHUNK_SIZE (1024 * 1024)
+
+enum state { EMPTY, QUEUED, HASHING, DONE };
+
+struct slot {
+    struct hashjob job;
+    enum state state;
+};
+
+struct hashpool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // Workers wait here for jobs
+    pthread_cond_t done;  // The writer waits here for results
+    pthread_cond_t space; // The submitter waits here for room
+
+    struct slot ring[RING_SIZE];
+    uint64_t next_seq;  // Next sequence number to submit
+    uint64_t next_work; // Next job for the workers
+    uint64_t next_emit; // Next job for the writer
+
+    uint64_t inflight, max_inflight; // Bytes being hashed
+    bool quit;
+
+    hashpool_emit emit;
+    void *arg;
+
+    pthread_t *workers, writer;
+    unsigned nworkers;
+};
+
+// Read the file in chunks and hash it. Returns 0 or an errno value.
+static int hash_file(struct hashjob *job, char *buf)
+{
+    gcry_md_hd_t hd;
+    ssize_t nread;
+    int fd, err = 0;
+
+    if ((fd = open(job->path, O_RDONLY)) == -1)
+        return errno;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (gcry_md_open(&hd, GCRY_MD_SHA1, 0) != 0) {
+        close(fd);
+        return ENOMEM;
+    }
+
+    while ((nread = read(fd, buf, CHUNK_SIZE)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR)
+                continue;
+
+            err = errno;
+            break;
+        }
+
+        gcry_md_write(hd, buf, nread);
+    }
+
+    if (err == 0)
+        memcpy(job->digest, gcry_md_read(hd, GCRY_MD_SHA1), sizeof job->digest);
+
+    gcry_md_close(hd);
+    close(fd);
+    return err;
+}
+
+static void *worker(void *arg)
+{
+    struct hashpool *p = arg;
+    struct slot *s;
+    char *buf;
+
+    if ((buf = malloc(CHUNK_SIZE)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->quit && p->next_work == p->next_seq)
+            pthread_cond_wait(&p->work, &p->lock);
+
+        if (p->next_work == p->next_seq)
+            break;
+
+        // Known digests are DONE already, and we skip them. A slot may
+        // also have been emptied and reused for a later job, which we
+        // may then hash early. That's fine, as long as we claim it.
+        s = &p->ring[p->next_work++ % RING_SIZE];
+        if (s->state != QUEUED)
+            continue;
+
+        s->state = HASHING;
+        pthread_mutex_unlock(&p->lock);
+        s->job.err = hash_file(&s->job, buf);
+        pthread_mutex_lock(&p->lock);
+
+        s->state = DONE;
+        p->inflight -= s->job.sb.st_size;
+        pthread_cond_signal(&p->done);
+        pthread_cond_broadcast(&p->space);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    free(buf);
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    struct hashpool *p = arg;
+    struct slot *s;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        s = &p->ring[p->next_emit % RING_SIZE];
+        while (p->next_emit < p->next_seq && s->state != DONE)
+            pthread_cond_wait(&p->done, &p->lock);
+
+        if (p->next_emit == p->next_seq) {
+            if (p->quit)
+                break;
+
+            pthread_cond_wait(&p->done, &p->lock);
+            continue;
+        }
+
+        // The slot is ours until we mark it empty.
+        pthread_mutex_unlock(&p->lock);
+        p->emit(&s->job, p->arg);
+        free(s->job.path);
+        pthread_mutex_lock(&p->lock);
+
+        s->state = EMPTY;
+        p->next_emit++;
+        pthread_cond_broadcast(&p->space);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct hashpool *hashpool_new(unsigned nthreads, uint64_t max_inflight, hashpool_emit emit, void *arg)
+{
+    struct hashpool *p;
+    unsigned i;
+
+    assert(nthreads > 0);
+    assert(emit != NULL);
+
+    if ((p = calloc(1, sizeof *p)) == NULL)
+        return NULL;
+
+    if ((p->workers = calloc(nthreads, sizeof *p->workers)) == NULL) {
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    pthread_cond_init(&p->space, NULL);
+    p->max_inflight = max_inflight;
+    p->emit = emit;
+    p->arg = arg;
+
+    if (pthread_create(&p->writer, NULL, writer, p) != 0) {
+        free(p->workers);
+        free(p);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&p->workers[i], NULL, worker, p) != 0)
+            break;
+    }
+
+    // We can live with fewer workers, but not with none.
+    p->nworkers = i;
+    if (p->nworkers == 0) {
+        hashpool_free(p);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    return p;
+}
+
+static int add(struct hashpool *p, const char *path, const struct stat *sb,
+    const unsigned char *digest, long tag)
+{
+    uint64_t size = digest == NULL ? (uint64_t)sb->st_size : 0;
+    struct slot *s;
+    char *copy;
+
+    if ((copy = strdup(path)) == NULL)
+        return -1;
+
+    pthread_mutex_lock(&p->lock);
+
+    // A file bigger than max_inflight still gets hashed, on its own.
+    while (p->next_seq - p->next_emit == RING_SIZE
+    || (size > 0 && p->inflight > 0 && p->inflight + size > p->max_inflight))
+        pthread_cond_wait(&p->space, &p->lock);
+
+    s = &p->ring[p->next_seq % RING_SIZE];
+    s->job.path = copy;
+    s->job.sb = *sb;
+    s->job.hashed = digest == NULL;
+    s->job.err = 0;
+    s->job.tag = tag;
+
+    if (digest != NULL) {
+        memcpy(s->job.digest, digest, sizeof s->job.digest);
+        s->state = DONE;
+        pthread_cond_signal(&p->done);
+    }
+    else {
+        s->state = QUEUED;
+        p->inflight += size;
+        pthread_cond_signal(&p->work);
+    }
+
+    p->next_seq++;
+
+    // The writer may be waiting for this one.
+    if (p->next_seq - p->next_emit == 1)
+        pthread_cond_signal(&p->done);
+
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+int hashpool_submit(struct hashpool *p, const char *path, const struct stat *sb, long tag)
+{
+    assert(p != NULL);
+    assert(path != NULL);
+    assert(sb != NULL);
+
+    return add(p, path, sb, NULL, tag);
+}
+
+int hashpool_put(struct hashpool *p, const char *path, const struct stat *sb, const unsigned char *digest, long tag)
+{
+    assert(p != NULL);
+    assert(path != NULL);
+    assert(sb != NULL);
+    assert(digest != NULL);
+
+    return add(p, path, sb, digest, tag);
+}
+
+void hashpool_wait(struct hashpool *p)
+{
+    assert(p != NULL);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->next_emit != p->next_seq)
+        pthread_cond_wait(&p->space, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void hashpool_free(struct hashpool *p)
+{
+    unsigned i;
+
+    if (p == NULL)
+        return;
+
+    hashpool_wait(p);
+
+    pthread_mutex_lock(&p->lock);
+    p->quit = true;
+    pthread_cond_broadcast(&p->work);
+    pthread_cond_broadcast(&p->done);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->nworkers; i++)
+        pthread_join(p->workers[i], NULL);
+    pthread_join(p->writer, NULL);
+
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->space);
+    pthread_mutex_destroy(&p->lock);
+    free(p->workers);
+    free(p);
+}
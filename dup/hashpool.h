@@ -0,0 +1,49 @@
+#ifndef HASHPOOL_H
+#define HASHPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+#include "dupdb.h"
+
+/* Hash files on a pool of threads. Files are submitted from one thread,
+ * hashed by the workers in any order, and handed to an emit function,
+ * running on a separate writer thread, in the order they were submitted.
+ * Files are read in chunks, so memory use doesn't depend on file size.
+ *
+ * Results which are already known, e.g., digests from a previous
+ * database, can be put in the pool too, so they're emitted in order
+ * with the rest. */
+struct hashjob {
+    char *path;
+    struct stat sb;
+    unsigned char digest[DUPDB_DIGEST_SIZE];
+    bool hashed; /* false if the digest was put in the pool as is */
+    int err;     /* errno if we couldn't read the file, else 0 */
+    long tag;    /* For the caller */
+};
+
+typedef void (*hashpool_emit)(const struct hashjob *job, void *arg);
+
+struct hashpool;
+
+/* Start nthreads workers and a writer. Submitting blocks while more than
+ * max_inflight bytes are being hashed, so we don't flood the disks.
+ * Returns NULL with errno set on errors. */
+struct hashpool *hashpool_new(unsigned nthreads, uint64_t max_inflight, hashpool_emit emit, void *arg);
+
+/* Hash a file. Returns -1 with errno set if we're out of memory. */
+int hashpool_submit(struct hashpool *p, const char *path, const struct stat *sb, long tag);
+
+/* Emit a known digest, in order with the hashed files. */
+int hashpool_put(struct hashpool *p, const char *path, const struct stat *sb, const unsigned char *digest, long tag);
+
+/* Wait until everything submitted so far has been emitted. */
+void hashpool_wait(struct hashpool *p);
+
+/* Wait for the pool, and stop its threads. */
+void hashpool_free(struct hashpool *p);
+
+#endif
@@ -0,0 +1,172 @@
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#define JOURNAL_MAGIC "DUPJRNL\0"
+#define JOURNAL_VERSION 1
+
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct journal {
+    FILE *f;
+};
+
+static struct journal *journal_new(FILE *f)
+{
+    struct journal *j;
+
+    if ((j = malloc(sizeof *j)) == NULL) {
+        fclose(f);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    setvbuf(f, NULL, _IOFBF, 256 * 1024);
+    j->f = f;
+    return j;
+}
+
+struct journal *journal_create(const char *filename)
+{
+    struct journal_header h;
+    FILE *f;
+
+    assert(filename != NULL);
+
+    if ((f = fopen(filename, "w")) == NULL)
+        return NULL;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof h.magic);
+    h.version = JOURNAL_VERSION;
+    h.record_size = sizeof(struct dupdb_record);
+
+    if (fwrite(&h, sizeof h, 1, f) != 1) {
+        int err = errno;
+        fclose(f);
+        errno = err;
+        return NULL;
+    }
+
+    return journal_new(f);
+}
+
+struct journal *journal_reopen(const char *filename, uint64_t length)
+{
+    FILE *f;
+
+    assert(filename != NULL);
+
+    if (length < sizeof(struct journal_header)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (truncate(filename, length) == -1 || (f = fopen(filename, "a")) == NULL)
+        return NULL;
+
+    return journal_new(f);
+}
+
+int journal_append(struct journal *j, const struct dupdb_entry *e, uint32_t diridx)
+{
+    uint32_t pathlen = strlen(e->path);
+
+    assert(j != NULL);
+
+    if (fwrite(&e->rec, sizeof e->rec, 1, j->f) != 1
+    || fwrite(&diridx, sizeof diridx, 1, j->f) != 1
+    || fwrite(&pathlen, sizeof pathlen, 1, j->f) != 1
+    || fwrite(e->path, 1, pathlen, j->f) != pathlen)
+        return -1;
+
+    return 0;
+}
+
+int journal_sync(struct journal *j, uint64_t *length)
+{
+    long pos;
+
+    assert(j != NULL);
+    assert(length != NULL);
+
+    if (fflush(j->f) == EOF || fdatasync(fileno(j->f)) == -1)
+        return -1;
+
+    if ((pos = ftell(j->f)) == -1)
+        return -1;
+
+    *length = pos;
+    return 0;
+}
+
+int journal_close(struct journal *j)
+{
+    int rc;
+
+    if (j == NULL)
+        return 0;
+
+    rc = fclose(j->f);
+    free(j);
+    return rc == EOF ? -1 : 0;
+}
+
+int journal_load(const char *filename, uint64_t length,
+    void (*fn)(const struct dupdb_entry *e, uint32_t diridx, void *arg), void *arg)
+{
+    struct journal_header h;
+    struct dupdb_entry e;
+    char path[PATH_MAX];
+    uint32_t diridx, pathlen;
+    uint64_t pos;
+    FILE *f;
+
+    assert(filename != NULL);
+    assert(fn != NULL);
+
+    if ((f = fopen(filename, "r")) == NULL)
+        return -1;
+
+    if (fread(&h, sizeof h, 1, f) != 1
+    || memcmp(h.magic, JOURNAL_MAGIC, sizeof h.magic) != 0
+    || h.version != JOURNAL_VERSION
+    || h.record_size != sizeof e.rec)
+        goto corrupt;
+
+    e.path = path;
+    for (pos = sizeof h; pos < length; pos += sizeof e.rec + sizeof diridx + sizeof pathlen + pathlen) {
+        if (fread(&e.rec, sizeof e.rec, 1, f) != 1
+        || fread(&diridx, sizeof diridx, 1, f) != 1
+        || fread(&pathlen, sizeof pathlen, 1, f) != 1
+        || pathlen >= sizeof path
+        || fread(path, 1, pathlen, f) != pathlen)
+            goto corrupt;
+
+        path[pathlen] = '\0';
+        fn(&e, diridx, arg);
+    }
+
+    if (pos != length)
+        goto corrupt;
+
+    fclose(f);
+    return 0;
+
+corrupt:
+    fclose(f);
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dupdb.h"
+
+/* dupdate appends every file it has hashed to a journal, so an interrupted
+ * run can be resumed. The journal is a small header followed by records:
+ *   struct dupdb_record (path_id is unused)
+ *   uint32_t diridx, the search directory the file was found in
+ *   uint32_t pathlen
+ *   the path, without a terminating NUL
+ * Numbers are in native byte order, like in the database.
+ *
+ * Only the first length bytes, as returned by journal_sync(), are
+ * guaranteed to be on disk. Anything after that may be torn. */
+struct journal;
+
+/* Create a new, empty journal. Returns NULL with errno set on errors. */
+struct journal *journal_create(const char *filename);
+
+/* Open an existing journal for appending, after truncating it to length. */
+struct journal *journal_reopen(const char *filename, uint64_t length);
+
+int journal_append(struct journal *j, const struct dupdb_entry *e, uint32_t diridx);
+
+/* Flush and fdatasync() the journal. Sets *length to the number of bytes
+ * which are now safely on disk. */
+int journal_sync(struct journal *j, uint64_t *length);
+
+int journal_close(struct journal *j);
+
+/* Read the first length bytes of a journal, calling fn() for each record.
+ * e->path is only valid during the call. Returns 0 on success, -1 with
+ * errno set on errors. errno is EINVAL if the journal is corrupt. */
+int journal_load(const char *filename, uint64_t length,
+    void (*fn)(const struct dupdb_entry *e, uint32_t diridx, void *arg), void *arg);
+
+#endif
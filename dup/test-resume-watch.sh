@@ -0,0 +1,63 @@
+#!/bin/sh
+# Resume an interrupted run with --watch, then make inotify overflow so
+# dupdate scans everything again. The rewritten database must still have
+# the files from the directories which were done before the interruption.
+#
+# We interrupt the first run by making the database a non-empty directory,
+# so saving it fails after the journal and checkpoint are written. Then we
+# set the checkpoint back to one directory done. The overflow comes from
+# creating more files than inotify queues while dupdate is stopped.
+
+bindir=$(pwd)
+max_events=$(cat /proc/sys/fs/inotify/max_queued_events 2>/dev/null) || exit 77
+test "$max_events" -le 100000 || exit 77
+
+tmp=$(mktemp -d) || exit 1
+trap 'kill -9 $pid 2>/dev/null; rm -rf "$tmp"' EXIT
+cd "$tmp" || exit 1
+
+fail()
+{
+    echo "FAIL: $*"
+    cat log
+    exit 1
+}
+
+mkdir d1 d2 .dupdb
+echo same > d1/a
+echo same > d2/b
+echo other > d2/c
+touch .dupdb/busy
+
+"$bindir/dupdate" -s d1 d2 2>/dev/null && fail "the first run should fail to save"
+test -f .dupdb.checkpoint || fail "no checkpoint"
+sed 's/^done 2$/done 1/' .dupdb.checkpoint > checkpoint && mv checkpoint .dupdb.checkpoint
+rm -r .dupdb
+
+"$bindir/dupdate" -v --resume --watch=1 2>log &
+pid=$!
+
+wait_for()
+{
+    n=0
+    until grep -q "$1" log; do
+        n=$((n + 1))
+        test $n -le 100 || fail "timed out waiting for: $1"
+        sleep 0.1
+    done
+}
+
+wait_for "Watching for changes"
+kill -STOP $pid
+seq 1 $((max_events + 100)) | (cd d2 && xargs touch)
+seq 1 $((max_events + 100)) | (cd d2 && xargs rm)
+kill -CONT $pid
+
+wait_for "Lost track of changes"
+kill -TERM $pid
+wait $pid || fail "dupdate exited with $?"
+
+"$bindir/dupfind" > found
+grep -q "d1/a" found || fail "d1 is missing from the rewritten database"
+grep -q "d2/b" found || fail "d2 is missing from the rewritten database"
+exit 0
@@ -0,0 +1,162 @@
+#include "watch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// Close and rename cover everything which changes contents, except
+// hard links, which only show up as IN_CREATE.
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM \
+    | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+struct watch {
+    int fd;
+    char **paths; // Indexed by watch descriptor
+    size_t npaths;
+};
+
+struct watch *watch_open(void)
+{
+    struct watch *w;
+
+    if ((w = calloc(1, sizeof *w)) == NULL)
+        return NULL;
+
+    if ((w->fd = inotify_init1(IN_CLOEXEC)) == -1) {
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+void watch_close(struct watch *w)
+{
+    size_t i;
+
+    if (w != NULL) {
+        close(w->fd);
+        for (i = 0; i < w->npaths; i++)
+            free(w->paths[i]);
+
+        free(w->paths);
+        free(w);
+    }
+}
+
+int watch_add(struct watch *w, const char *dir)
+{
+    char **tmp, *path;
+    size_t n;
+    int wd;
+
+    assert(w != NULL);
+    assert(dir != NULL);
+
+    if ((wd = inotify_add_watch(w->fd, dir, WATCH_MASK)) == -1)
+        return -1;
+
+    if ((size_t)wd >= w->npaths) {
+        n = (size_t)wd >= w->npaths * 2 ? (size_t)wd + 1 : w->npaths * 2;
+        if ((tmp = realloc(w->paths, n * sizeof *tmp)) == NULL)
+            return -1;
+
+        memset(tmp + w->npaths, 0, (n - w->npaths) * sizeof *tmp);
+        w->paths = tmp;
+        w->npaths = n;
+    }
+
+    if ((path = strdup(dir)) == NULL)
+        return -1;
+
+    free(w->paths[wd]);
+    w->paths[wd] = path;
+    return 0;
+}
+
+// A directory moved out of our trees is still watched by inotify, and
+// would report changes with stale paths. We stop watching it and its
+// subdirectories. If it was moved within the trees, the caller adds it
+// again, with its new path.
+static void remove_tree(struct watch *w, const char *dir)
+{
+    size_t i, len = strlen(dir);
+
+    for (i = 0; i < w->npaths; i++) {
+        if (w->paths[i] != NULL && strncmp(w->paths[i], dir, len) == 0
+        && (w->paths[i][len] == '\0' || w->paths[i][len] == '/')) {
+            inotify_rm_watch(w->fd, i);
+            free(w->paths[i]);
+            w->paths[i] = NULL;
+        }
+    }
+}
+
+int watch_read(struct watch *w, int timeout_ms,
+    void (*fn)(enum watch_event event, const char *path, void *arg), void *arg)
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    const struct inotify_event *ev;
+    struct pollfd pfd;
+    ssize_t nread, i;
+    int rc, nevents = 0;
+
+    assert(w != NULL);
+    assert(fn != NULL);
+
+    pfd.fd = w->fd;
+    pfd.events = POLLIN;
+    if ((rc = poll(&pfd, 1, timeout_ms)) <= 0)
+        return rc;
+
+    if ((nread = read(w->fd, buf, sizeof buf)) == -1)
+        return -1;
+
+    for (i = 0; i < nread; i += sizeof *ev + ev->len) {
+        ev = (const struct inotify_event *)&buf[i];
+        nevents++;
+
+        if (ev->mask & IN_Q_OVERFLOW) {
+            fn(WATCH_OVERFLOW, NULL, arg);
+            continue;
+        }
+
+        if (ev->wd < 0 || (size_t)ev->wd >= w->npaths || w->paths[ev->wd] == NULL)
+            continue;
+
+        if (ev->mask & IN_IGNORED) {
+            free(w->paths[ev->wd]);
+            w->paths[ev->wd] = NULL;
+            continue;
+        }
+
+        if (ev->len == 0)
+            continue;
+
+        if ((size_t)snprintf(path, sizeof path, "%s/%s", w->paths[ev->wd], ev->name) >= sizeof path)
+            continue;
+
+        if (ev->mask & IN_ISDIR) {
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+                fn(WATCH_DIR_ADDED, path, arg);
+            else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                remove_tree(w, path);
+                fn(WATCH_DIR_REMOVED, path, arg);
+            }
+        }
+        else if (ev->mask & (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO))
+            fn(WATCH_CHANGED, path, arg);
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+            fn(WATCH_REMOVED, path, arg);
+    }
+
+    return nevents;
+}
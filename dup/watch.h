@@ -0,0 +1,35 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/* Watch directory trees for changes with inotify. inotify watches single
+ * directories, so the caller adds every directory in the trees, and new
+ * directories as they are reported. We keep track of the path of each
+ * watched directory, and report changes by path.
+ *
+ * We report changes to file contents, not to metadata, and directories
+ * which are moved away or deleted, but not the files in them. */
+enum watch_event {
+    WATCH_CHANGED,     /* A file was written, created or moved here */
+    WATCH_REMOVED,     /* A file was deleted or moved away */
+    WATCH_DIR_ADDED,   /* A directory was created or moved here */
+    WATCH_DIR_REMOVED, /* A directory was deleted or moved away */
+    WATCH_OVERFLOW     /* Events were lost. path is NULL. */
+};
+
+struct watch;
+
+/* Returns NULL with errno set on errors. */
+struct watch *watch_open(void);
+void watch_close(struct watch *w);
+
+/* Watch the directory dir, but not its subdirectories. Adding a directory
+ * again updates its path. Returns 0 on success, -1 with errno set. */
+int watch_add(struct watch *w, const char *dir);
+
+/* Wait up to timeout_ms milliseconds, -1 for ever, for events, and call
+ * fn once per event. Returns the number of events, 0 on timeouts,
+ * or -1 with errno set. errno is EINTR if a signal interrupted us. */
+int watch_read(struct watch *w, int timeout_ms,
+    void (*fn)(enum watch_event event, const char *path, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,816 @@
+// fdf -- find duplicate files, with LMDB as storage.
+// See README.fdf for the background. In short: we index file systems
+// into an LMDB environment, and then answer questions like "which files
+// are duplicates of X?" or "which files under Y have duplicates?"
+// without traversing and hashing everything again.
+//
+// DB design:
+// We have four subdbs.
+// - file:   realpath -> struct record. One entry per file.
+// - size:   file size -> realpath. DUPSORT, so one key has many paths.
+// - digest: full hash -> realpath. DUPSORT too.
+// - meta:   misc. values, like the current scan generation.
+//
+// Files are hashed lazily. A file with a unique size is never hashed,
+// since it can't have duplicates. When two or more files have the same
+// size, we hash the first 4K, then the first 1M, then the full file,
+// and stop as soon as the file's hash differs from all the other files'
+// hashes. The hashes are stored in the record, so each tier of each
+// file is computed at most once. This gives us an invariant among the
+// indexed files: two indexed files with the same content both have a
+// full hash, and both are in the digest subdb. An indexed file without
+// a full hash has no indexed duplicates. It says nothing about files
+// which aren't indexed, so they're resolved against the size subdb.
+//
+// LMDB limits keys and DUPSORT values to mdb_env_get_maxkeysize() bytes,
+// 511 by default. Longer paths are skipped with a warning.
+//
+// boa@20261019
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+#include <gcrypt.h>
+#include <lmdb.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int ftw_flags = FTW_ACTIONRETVAL | FTW_PHYS;
+int verbose = 0;
+int silent = 0; // print error messages? (Some will always be printed)
+
+// What to do. One mode per run.
+enum mode { MODE_NONE, MODE_UPDATE, MODE_QUERY, MODE_PREFIX };
+static enum mode mode = MODE_NONE;
+static const char *prefix;
+static const char *dbdir;
+static size_t mapsize_gb = 64;
+
+#define DIGEST_SIZE 20 // SHA1
+
+// The hash tiers. A tier's hash covers the first limit bytes of the file.
+// The last tier whose limit is less than the file size is the last tier
+// we need before the full hash.
+enum { TIER_4K, TIER_1M, TIER_FULL, NTIERS };
+static const uint64_t tier_limits[NTIERS] = { 4096, 1024 * 1024, UINT64_MAX };
+
+struct record {
+    uint64_t dev, ino, size;
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t generation; // Scan which saw this file last.
+    uint32_t flags;      // Bit n set means hashes[n] is valid.
+    unsigned char hashes[NTIERS][DIGEST_SIZE];
+};
+
+static MDB_env *env;
+static MDB_dbi dbi_file, dbi_size, dbi_digest, dbi_meta;
+static MDB_txn *txn;
+static size_t maxkeysize;
+static uint64_t generation;
+
+static struct {
+    unsigned long seen, unchanged, added, removed, hashed[NTIERS];
+} counts;
+
+static void die_mdb(const char *what, int rc)
+{
+    fprintf(stderr, "%s: %s\n", what, mdb_strerror(rc));
+    exit(EXIT_FAILURE);
+}
+
+static void show_usage(void)
+{
+    static const char *text[] = {
+        "USAGE: fdf [options] -u path...",
+        "       fdf [options] -q file...",
+        "       fdf [options] -p directory",
+        "",
+        "-u Update the database with all files in the paths. Files which",
+        "   are gone, are removed from the database.",
+        "-q Print all duplicates of each file.",
+        "-p Print all groups of duplicates with at least one file under directory.",
+        "",
+        "options",
+        "-D dir  Database directory. Default is $HOME/.fdf",
+        "-M gb   Max database size in GB. Default is 64",
+        "-x Stay on file system. Dont' traverse into mounted filesystems.",
+        "-v Verbose. Print info as we progress.",
+        "-s silent. Don't print (most) error messages.",
+        "",
+    };
+
+    size_t i, n = sizeof text / sizeof *text;
+    for (i = 0; i < n; i++)
+        puts(text[i]);
+}
+
+static void set_mode(enum mode m)
+{
+    if (mode != MODE_NONE) {
+        fprintf(stderr, "error: -u, -q and -p are mutually exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    mode = m;
+}
+
+static void parse_command_line(int argc, char *argv[])
+{
+    int c;
+    const char *options = "hvsxuqp:D:M:";
+
+    while ((c = getopt(argc, argv, options)) != -1) {
+        switch (c) {
+            case 'h':
+                show_usage();
+                exit(EXIT_SUCCESS);
+
+            case 'u':
+                set_mode(MODE_UPDATE);
+                break;
+
+            case 'q':
+                set_mode(MODE_QUERY);
+                break;
+
+            case 'p':
+                set_mode(MODE_PREFIX);
+                prefix = optarg;
+                break;
+
+            case 'D':
+                dbdir = optarg;
+                break;
+
+            case 'M':
+                mapsize_gb = strtoul(optarg, NULL, 10);
+                break;
+
+            case 's':
+                silent = 1;
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'x':
+                ftw_flags |= FTW_MOUNT;
+                break;
+
+            case '?':
+            default:
+                show_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (mode == MODE_NONE || (mode != MODE_PREFIX && optind == argc) || mapsize_gb == 0) {
+        show_usage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void open_db(bool readonly)
+{
+    static char defaultdir[PATH_MAX];
+    unsigned flags = readonly ? MDB_RDONLY : 0;
+    int rc;
+
+    if (dbdir == NULL) {
+        const char *home = getenv("HOME");
+
+        if (home == NULL) {
+            fprintf(stderr, "error: HOME not set. Use -D\n");
+            exit(EXIT_FAILURE);
+        }
+
+        snprintf(defaultdir, sizeof defaultdir, "%s/.fdf", home);
+        dbdir = defaultdir;
+    }
+
+    if (!readonly && mkdir(dbdir, 0700) == -1 && errno != EEXIST) {
+        perror(dbdir);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((rc = mdb_env_create(&env)) != 0)
+        die_mdb("mdb_env_create", rc);
+
+    mdb_env_set_maxdbs(env, 4);
+    if ((rc = mdb_env_set_mapsize(env, mapsize_gb << 30)) != 0)
+        die_mdb("mdb_env_set_mapsize", rc);
+
+    if ((rc = mdb_env_open(env, dbdir, flags, 0600)) != 0)
+        die_mdb(dbdir, rc);
+
+    maxkeysize = mdb_env_get_maxkeysize(env);
+
+    if ((rc = mdb_txn_begin(env, NULL, flags, &txn)) != 0)
+        die_mdb("mdb_txn_begin", rc);
+
+    flags = readonly ? 0 : MDB_CREATE;
+    if ((rc = mdb_dbi_open(txn, "file", flags, &dbi_file)) != 0
+    || (rc = mdb_dbi_open(txn, "size", flags | MDB_DUPSORT | MDB_INTEGERKEY, &dbi_size)) != 0
+    || (rc = mdb_dbi_open(txn, "digest", flags | MDB_DUPSORT, &dbi_digest)) != 0
+    || (rc = mdb_dbi_open(txn, "meta", flags, &dbi_meta)) != 0)
+        die_mdb("mdb_dbi_open", rc);
+}
+
+static void commit(bool reopen)
+{
+    int rc;
+
+    if ((rc = mdb_txn_commit(txn)) != 0)
+        die_mdb("mdb_txn_commit", rc);
+
+    txn = NULL;
+    if (reopen && (rc = mdb_txn_begin(env, NULL, 0, &txn)) != 0)
+        die_mdb("mdb_txn_begin", rc);
+}
+
+static void close_db(void)
+{
+    if (txn != NULL)
+        mdb_txn_abort(txn);
+
+    mdb_env_close(env);
+}
+
+static inline MDB_val val(const void *data, size_t size)
+{
+    MDB_val v = { .mv_size = size, .mv_data = (void *)data };
+    return v;
+}
+
+// The tier whose hash covers the full file.
+static inline int final_tier(uint64_t size)
+{
+    int t = 0;
+
+    while (tier_limits[t] < size)
+        t++;
+
+    return t;
+}
+
+static bool get_record(const char *path, struct record *rec)
+{
+    MDB_val k = val(path, strlen(path)), v;
+    int rc = mdb_get(txn, dbi_file, &k, &v);
+
+    if (rc == MDB_NOTFOUND)
+        return false;
+    if (rc != 0)
+        die_mdb("mdb_get", rc);
+
+    // Copy, as the data is only valid until the next update.
+    assert(v.mv_size == sizeof *rec);
+    memcpy(rec, v.mv_data, sizeof *rec);
+    return true;
+}
+
+static void put(MDB_dbi dbi, MDB_val k, MDB_val v)
+{
+    int rc = mdb_put(txn, dbi, &k, &v, 0);
+
+    if (rc != 0 && rc != MDB_KEYEXIST)
+        die_mdb("mdb_put", rc);
+}
+
+static void del(MDB_dbi dbi, MDB_val k, MDB_val v)
+{
+    int rc = mdb_del(txn, dbi, &k, &v);
+
+    if (rc != 0 && rc != MDB_NOTFOUND)
+        die_mdb("mdb_del", rc);
+}
+
+static void put_record(const char *path, const struct record *rec)
+{
+    put(dbi_file, val(path, strlen(path)), val(rec, sizeof *rec));
+}
+
+// Remove a file from all subdbs.
+static void remove_file(const char *path, const struct record *rec)
+{
+    size_t len = strlen(path), size = rec->size;
+    int t = final_tier(rec->size);
+
+    del(dbi_size, val(&size, sizeof size), val(path, len));
+    if (rec->flags & (1u << t))
+        del(dbi_digest, val(rec->hashes[t], DIGEST_SIZE), val(path, len));
+
+    del(dbi_file, val(path, len), val(NULL, 0));
+    counts.removed++;
+}
+
+// Hash the first limit bytes of path. Returns false if the file is
+// unreadable, or changed size since we stat'ed it.
+static bool hash_file(const char *path, uint64_t size, uint64_t limit, unsigned char *digest)
+{
+    static char buf[1024 * 1024];
+    uint64_t left = size < limit ? size : limit;
+    gcry_md_hd_t md;
+    ssize_t nread;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        if (!silent)
+            perror(path);
+        return false;
+    }
+
+    if (gcry_md_open(&md, GCRY_MD_SHA1, 0) != 0) {
+        fprintf(stderr, "Could not create hash context\n");
+        exit(EXIT_FAILURE);
+    }
+
+    posix_fadvise(fd, 0, left, POSIX_FADV_SEQUENTIAL);
+    while (left > 0) {
+        size_t n = left < sizeof buf ? left : sizeof buf;
+
+        if ((nread = read(fd, buf, n)) <= 0)
+            break;
+
+        gcry_md_write(md, buf, nread);
+        left -= nread;
+    }
+
+    close(fd);
+    if (left == 0)
+        memcpy(digest, gcry_md_read(md, GCRY_MD_SHA1), DIGEST_SIZE);
+    else if (!silent)
+        fprintf(stderr, "%s: file changed while reading it\n", path);
+
+    gcry_md_close(md);
+    return left == 0;
+}
+
+// Make sure that rec has a hash for tier t. Updates the db if we had to
+// compute it, and adds the file to the digest subdb for the final tier.
+static bool ensure_hash(const char *path, struct record *rec, int t)
+{
+    if (rec->flags & (1u << t))
+        return true;
+
+    if (!hash_file(path, rec->size, tier_limits[t], rec->hashes[t]))
+        return false;
+
+    counts.hashed[t]++;
+    rec->flags |= 1u << t;
+    put_record(path, rec);
+
+    if (t == final_tier(rec->size))
+        put(dbi_digest, val(rec->hashes[t], DIGEST_SIZE), val(path, strlen(path)));
+
+    return true;
+}
+
+// All paths with a given size, except path itself.
+static char **same_size(const char *path, uint64_t size, size_t *count)
+{
+    size_t key = size, n = 0, nmax = 0;
+    MDB_val k = val(&key, sizeof key), v;
+    MDB_cursor *cur;
+    char **paths = NULL;
+    int rc;
+
+    if ((rc = mdb_cursor_open(txn, dbi_size, &cur)) != 0)
+        die_mdb("mdb_cursor_open", rc);
+
+    for (rc = mdb_cursor_get(cur, &k, &v, MDB_SET); rc == 0; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT_DUP)) {
+        if (v.mv_size == strlen(path) && memcmp(v.mv_data, path, v.mv_size) == 0)
+            continue;
+
+        if (n == nmax) {
+            nmax = nmax == 0 ? 16 : nmax * 2;
+            if ((paths = realloc(paths, nmax * sizeof *paths)) == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if ((paths[n] = strndup(v.mv_data, v.mv_size)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        n++;
+    }
+
+    mdb_cursor_close(cur);
+    *count = n;
+    return paths;
+}
+
+// Hash path and the indexed files of the same size, tier by tier, as
+// long as some other file has the same hash as path. The other files'
+// hashes are stored. So are path's, if it's indexed. Returns the files
+// with the same content as path, or NULL if there are none.
+static char **same_content(const char *path, struct record *rec, bool indexed, size_t *count)
+{
+    struct record other;
+    size_t i, n, ncand;
+    char **paths = same_size(path, rec->size, &n);
+    int t, last = final_tier(rec->size);
+
+    for (t = 0, ncand = n; t <= last && ncand > 0; t++) {
+        if (indexed && !ensure_hash(path, rec, t))
+            break;
+
+        if (!indexed && !(rec->flags & (1u << t))) {
+            if (!hash_file(path, rec->size, tier_limits[t], rec->hashes[t]))
+                break;
+            rec->flags |= 1u << t;
+        }
+
+        for (i = ncand = 0; i < n; i++) {
+            if (!get_record(paths[i], &other) || !ensure_hash(paths[i], &other, t)) {
+                free(paths[i]);
+                continue;
+            }
+
+            if (memcmp(other.hashes[t], rec->hashes[t], DIGEST_SIZE) == 0)
+                paths[ncand++] = paths[i];
+            else
+                free(paths[i]);
+        }
+
+        n = ncand;
+    }
+
+    // We're done if we got past the final tier, with files left.
+    if (t <= last || n == 0) {
+        for (i = 0; i < n; i++)
+            free(paths[i]);
+        free(paths);
+        *count = 0;
+        return NULL;
+    }
+
+    *count = n;
+    return paths;
+}
+
+static void resolve_size_group(const char *path, struct record *rec)
+{
+    size_t i, n;
+    char **paths = same_content(path, rec, true, &n);
+
+    for (i = 0; i < n; i++)
+        free(paths[i]);
+    free(paths);
+}
+
+// Insert or update a file. Unchanged files keep their hashes.
+static void upsert(const char *path, const struct stat *sb)
+{
+    struct record rec;
+    size_t size = sb->st_size;
+
+    counts.seen++;
+    if (get_record(path, &rec)) {
+        if (rec.dev == (uint64_t)sb->st_dev && rec.ino == (uint64_t)sb->st_ino
+        && rec.size == (uint64_t)sb->st_size && rec.mtime_sec == sb->st_mtim.tv_sec
+        && rec.mtime_nsec == sb->st_mtim.tv_nsec) {
+            rec.generation = generation;
+            put_record(path, &rec);
+            counts.unchanged++;
+            return;
+        }
+
+        remove_file(path, &rec);
+    }
+
+    memset(&rec, 0, sizeof rec);
+    rec.dev = sb->st_dev;
+    rec.ino = sb->st_ino;
+    rec.size = sb->st_size;
+    rec.mtime_sec = sb->st_mtim.tv_sec;
+    rec.mtime_nsec = sb->st_mtim.tv_nsec;
+    rec.generation = generation;
+
+    put_record(path, &rec);
+    put(dbi_size, val(&size, sizeof size), val(path, strlen(path)));
+    counts.added++;
+
+    resolve_size_group(path, &rec);
+}
+
+int update_callback(const char *fpath, const struct stat *sb,
+    int typeflag __attribute__((unused)),
+    struct FTW *ftwbuf __attribute__((unused)))
+{
+    char path[PATH_MAX];
+
+    // Ignore anything but regular files with content
+    if (!S_ISREG(sb->st_mode) || sb->st_size == 0)
+        return FTW_CONTINUE;
+
+    if (realpath(fpath, path) == NULL) {
+        if (!silent)
+            perror(fpath);
+        return FTW_CONTINUE;
+    }
+
+    if (strlen(path) > maxkeysize) {
+        if (!silent)
+            fprintf(stderr, "%s: path too long for the database, skipped\n", path);
+        return FTW_CONTINUE;
+    }
+
+    upsert(path, sb);
+
+    // Don't let the write transaction grow without bounds.
+    if (counts.seen % 10000 == 0) {
+        commit(true);
+        if (verbose)
+            fprintf(stderr, "\r%lu", counts.seen);
+    }
+
+    return FTW_CONTINUE;
+}
+
+// Remove records under dir which this scan didn't see. We can't delete
+// while iterating, so we collect the paths first.
+static void purge(const char *dir)
+{
+    size_t i, n = 0, nmax = 0, len = strlen(dir);
+    MDB_val k = val(dir, len), v;
+    MDB_cursor *cur;
+    struct record rec, *recs = NULL;
+    char **paths = NULL;
+    int rc;
+
+    if ((rc = mdb_cursor_open(txn, dbi_file, &cur)) != 0)
+        die_mdb("mdb_cursor_open", rc);
+
+    for (rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE); rc == 0; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) {
+        if (k.mv_size < len || memcmp(k.mv_data, dir, len) != 0)
+            break;
+
+        // We want dir/..., not dirfoo/...
+        if (k.mv_size > len && len > 1 && ((const char *)k.mv_data)[len] != '/')
+            continue;
+
+        memcpy(&rec, v.mv_data, sizeof rec);
+        if (rec.generation == generation)
+            continue;
+
+        if (n == nmax) {
+            nmax = nmax == 0 ? 1024 : nmax * 2;
+            paths = realloc(paths, nmax * sizeof *paths);
+            recs = realloc(recs, nmax * sizeof *recs);
+            if (paths == NULL || recs == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if ((paths[n] = strndup(k.mv_data, k.mv_size)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        recs[n++] = rec;
+    }
+
+    mdb_cursor_close(cur);
+
+    for (i = 0; i < n; i++) {
+        remove_file(paths[i], &recs[i]);
+        free(paths[i]);
+    }
+
+    free(paths);
+    free(recs);
+}
+
+// Each update run is a new generation. Files with an older generation
+// under the scanned directories are gone.
+static void next_generation(void)
+{
+    MDB_val k = val("generation", 10), v;
+    int rc;
+
+    if ((rc = mdb_get(txn, dbi_meta, &k, &v)) == 0 && v.mv_size == sizeof generation)
+        memcpy(&generation, v.mv_data, sizeof generation);
+    else if (rc != 0 && rc != MDB_NOTFOUND)
+        die_mdb("mdb_get", rc);
+
+    generation++;
+    put(dbi_meta, k, val(&generation, sizeof generation));
+}
+
+static void update(char *paths[])
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    open_db(false);
+    next_generation();
+
+    for (; *paths != NULL; paths++) {
+        if (realpath(*paths, path) == NULL || stat(path, &st) == -1) {
+            perror(*paths);
+            continue;
+        }
+
+        if (verbose)
+            fprintf(stderr, "Checking directory:%s\n", path);
+
+        nftw(path, update_callback, 12, ftw_flags);
+        if (S_ISDIR(st.st_mode))
+            purge(path);
+
+        if (verbose)
+            fprintf(stderr, "\n");
+    }
+
+    commit(false);
+    close_db();
+
+    if (verbose)
+        fprintf(stderr, "%lu files: %lu unchanged, %lu added, %lu removed. "
+            "Hashed %lu 4K, %lu 1M, %lu full\n", counts.seen, counts.unchanged,
+            counts.added, counts.removed, counts.hashed[TIER_4K],
+            counts.hashed[TIER_1M], counts.hashed[TIER_FULL]);
+}
+
+// Print all paths with the given digest, except skip.
+static size_t print_digest_group(const unsigned char *digest, const char *skip, const char *indent)
+{
+    MDB_val k = val(digest, DIGEST_SIZE), v;
+    MDB_cursor *cur;
+    size_t n = 0, skiplen = skip == NULL ? 0 : strlen(skip);
+    int rc;
+
+    if ((rc = mdb_cursor_open(txn, dbi_digest, &cur)) != 0)
+        die_mdb("mdb_cursor_open", rc);
+
+    for (rc = mdb_cursor_get(cur, &k, &v, MDB_SET); rc == 0; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT_DUP)) {
+        if (skip != NULL && v.mv_size == skiplen && memcmp(v.mv_data, skip, skiplen) == 0)
+            continue;
+
+        printf("%s%.*s\n", indent, (int)v.mv_size, (const char *)v.mv_data);
+        n++;
+    }
+
+    mdb_cursor_close(cur);
+    return n;
+}
+
+// Print duplicates of each file. Files which aren't in the database, or
+// changed since they were indexed, are compared with the indexed files
+// of the same size, tier by tier. That hashes indexed files which had
+// no need for it before, so we store their hashes, and need a write
+// transaction.
+static void query(char *files[])
+{
+    char path[PATH_MAX];
+    struct record rec;
+    struct stat st;
+    char **paths;
+    size_t i, n;
+
+    open_db(false);
+
+    for (; *files != NULL; files++) {
+        if (realpath(*files, path) == NULL || stat(path, &st) == -1) {
+            perror(*files);
+            continue;
+        }
+
+        if (get_record(path, &rec) && rec.size == (uint64_t)st.st_size
+        && rec.mtime_sec == st.st_mtim.tv_sec && rec.mtime_nsec == st.st_mtim.tv_nsec) {
+            int t = final_tier(rec.size);
+
+            // No full hash means no duplicates. See the top of this file.
+            if (rec.flags & (1u << t))
+                print_digest_group(rec.hashes[t], path, "");
+        }
+        else {
+            memset(&rec, 0, sizeof rec);
+            rec.size = st.st_size;
+            paths = same_content(path, &rec, false, &n);
+            for (i = 0; i < n; i++) {
+                printf("%s\n", paths[i]);
+                free(paths[i]);
+            }
+            free(paths);
+        }
+    }
+
+    commit(false);
+    close_db();
+}
+
+static int cmp_digest(const void *v1, const void *v2)
+{
+    return memcmp(v1, v2, DIGEST_SIZE);
+}
+
+// Print each group of duplicates which has a member under dir.
+static void query_prefix(const char *dir)
+{
+    char path[PATH_MAX];
+    unsigned char (*digests)[DIGEST_SIZE] = NULL;
+    size_t i, len, n = 0, nmax = 0, count;
+    MDB_cursor *cur, *dcur;
+    struct record rec;
+    MDB_val k, v, dk, dv;
+    int rc;
+
+    if (realpath(dir, path) == NULL) {
+        perror(dir);
+        exit(EXIT_FAILURE);
+    }
+
+    open_db(true);
+    len = strlen(path);
+    k = val(path, len);
+
+    if ((rc = mdb_cursor_open(txn, dbi_file, &cur)) != 0 || (rc = mdb_cursor_open(txn, dbi_digest, &dcur)) != 0)
+        die_mdb("mdb_cursor_open", rc);
+
+    for (rc = mdb_cursor_get(cur, &k, &v, MDB_SET_RANGE); rc == 0; rc = mdb_cursor_get(cur, &k, &v, MDB_NEXT)) {
+        if (k.mv_size < len || memcmp(k.mv_data, path, len) != 0)
+            break;
+
+        if ((len > 1 && k.mv_size > len && ((const char *)k.mv_data)[len] != '/'))
+            continue;
+
+        memcpy(&rec, v.mv_data, sizeof rec);
+        int t = final_tier(rec.size);
+        if (!(rec.flags & (1u << t)))
+            continue;
+
+        dk = val(rec.hashes[t], DIGEST_SIZE);
+        if (mdb_cursor_get(dcur, &dk, &dv, MDB_SET) != 0 || mdb_cursor_count(dcur, &count) != 0 || count < 2)
+            continue;
+
+        if (n == nmax) {
+            nmax = nmax == 0 ? 1024 : nmax * 2;
+            if ((digests = realloc(digests, nmax * DIGEST_SIZE)) == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        memcpy(digests[n++], rec.hashes[t], DIGEST_SIZE);
+    }
+
+    mdb_cursor_close(dcur);
+    mdb_cursor_close(cur);
+
+    // Several files under dir may be in the same group. Print it once.
+    qsort(digests, n, DIGEST_SIZE, cmp_digest);
+    for (i = 0; i < n; i++) {
+        if (i > 0 && memcmp(digests[i - 1], digests[i], DIGEST_SIZE) == 0)
+            continue;
+
+        if (i > 0)
+            printf("\n");
+        print_digest_group(digests[i], NULL, "");
+    }
+
+    free(digests);
+    close_db();
+}
+
+int main(int argc, char *argv[])
+{
+    parse_command_line(argc, argv);
+
+    if (!gcry_check_version(GCRYPT_VERSION)) {
+        fprintf(stderr, "libgcrypt version mismatch\n");
+        exit(EXIT_FAILURE);
+    }
+
+    switch (mode) {
+        case MODE_UPDATE:
+            update(&argv[optind]);
+            break;
+
+        case MODE_QUERY:
+            query(&argv[optind]);
+            break;
+
+        case MODE_PREFIX:
+            query_prefix(prefix);
+            break;
+
+        case MODE_NONE:
+            break;
+    }
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -6,12 +7,17 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
-#if 0
 __attribute__((format(printf,1,2)))
 static void die(const char *fmt, ...)
 {
@@ -23,8 +29,6 @@ static void die(const char *fmt, ...)
     exit(1);
 }
 
-#endif
-
 __attribute__((format(printf,1,2)))
 static void warning(const char *fmt, ...)
 {
@@ -37,9 +41,35 @@ static void warning(const char *fmt, ...)
 
 static void show_usage(void)
 {
-    // TODO: add usage text
     static const char *text[] = {
-        "usage: add your own text here",
+        "usage: filesize [options] [path...]",
+        "",
+        "Sums the sizes of the paths, or of paths read from stdin, one per line.",
+        "Directories are walked, and everything in them is counted, like du does.",
+        "Files with several hard links are counted once.",
+        "",
+        "For directories, we print the apparent size, the allocated size,",
+        "and the path, and a total at the end.",
+        "",
+        "options",
+        "-b Print bytes. This is the default.",
+        "-k, -m, -g Print KB, MB or GB.",
+        "-d depth Print directories down to depth levels below the paths too.",
+        "   The default is 0, the paths only.",
+        "-0 Paths on stdin are separated by NUL, as from find -print0, and",
+        "   are used as is. Otherwise they're separated by newlines, and",
+        "   trailing white space is removed.",
+        "-j threads Walk directories and stat paths from stdin with this many",
+        "   threads. The default is twice the number of CPUs, but at least 8,",
+        "   as we mostly wait for metadata. Use more on network file systems.",
+        "--hist Print the distribution of file sizes too: files and bytes in",
+        "   power of two buckets, p50, p90, p99 and max, and the largest files.",
+        "   Quantiles are within 1% of the real value.",
+        "--top n Print the n largest files with --hist. The default is 10.",
+        "--save-hist file Save the distribution to file, so it can be merged",
+        "   with others later.",
+        "--merge-hist file Add a saved distribution to ours. Can be given",
+        "   more than once. We don't read stdin if there are no paths.",
         "",
     };
 
@@ -51,14 +81,31 @@ static void show_usage(void)
 
 static unsigned long long g_factor = 1;
 static unsigned long long g_size = 0;
+static unsigned long long g_allocated = 0;
 static const char *suffix = "";
+static int g_maxdepth = 0;
+static long g_nthreads = 0;
+static bool g_walked = false; // Did we walk any directories?
+static char g_delim = '\n'; // Separates paths on stdin
+static bool g_hist = false;
+static size_t g_ntop = 10;
+static const char *g_savehist = NULL;
+static const char *g_mergehist[64];
+static size_t g_nmergehist = 0;
 
 static void parse_commandline(int argc, char *argv[])
 {
     int c;
-    const char *options = "bkmgh";
+    const char *options = "bkmgh0d:j:";
+    static const struct option longopts[] = {
+        { "hist", no_argument, NULL, 'H' },
+        { "top", required_argument, NULL, 'T' },
+        { "save-hist", required_argument, NULL, 'S' },
+        { "merge-hist", required_argument, NULL, 'M' },
+        { NULL, 0, NULL, 0 }
+    };
 
-    while ((c = getopt(argc, argv, options)) != EOF) {
+    while ((c = getopt_long(argc, argv, options, longopts, NULL)) != EOF) {
         switch (c) {
             case 'h':
                 show_usage();
@@ -83,6 +130,42 @@ static void parse_commandline(int argc, char *argv[])
                 g_factor = 1024 * 1024 * 1024;
                 break;
 
+            case '0':
+                g_delim = '\0';
+                break;
+
+            case 'd':
+                g_maxdepth = atoi(optarg);
+                if (g_maxdepth < 0)
+                    die("-d: depth can't be negative\n");
+                break;
+
+            case 'j':
+                g_nthreads = atol(optarg);
+                if (g_nthreads < 1)
+                    die("-j: need at least one thread\n");
+                break;
+
+            case 'H':
+                g_hist = true;
+                break;
+
+            case 'T':
+                g_ntop = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'S':
+                g_savehist = optarg;
+                g_hist = true;
+                break;
+
+            case 'M':
+                if (g_nmergehist == sizeof g_mergehist / sizeof *g_mergehist)
+                    die("Too many --merge-hist files\n");
+                g_mergehist[g_nmergehist++] = optarg;
+                g_hist = true;
+                break;
+
             case '?':
             default:
                 exit(1);
@@ -90,12 +173,730 @@ static void parse_commandline(int argc, char *argv[])
     }
 }
 
-static void printsize(void)
+static void printvalue(unsigned long long size)
 {
     if (g_factor == 1)
-        printf("%llu%s\n", g_size, suffix);
+        printf("%llu%s", size, suffix);
+    else
+        printf("%10.02g%s", 1.0 * size / g_factor, suffix);
+}
+
+static void printsize(void)
+{
+    printvalue(g_size);
+    if (g_walked) {
+        putchar('\t');
+        printvalue(g_allocated);
+        printf("\ttotal");
+    }
+
+    putchar('\n');
+}
+
+// With --hist, we keep the distribution of file sizes. Memory use is
+// constant, whatever the number of files. We count files and bytes in
+// power of two buckets, and keep a quantile sketch like DDSketch: a
+// count per bucket, where bucket i holds sizes in (gamma^(i-1), gamma^i].
+// Any quantile is then within ALPHA of the real value. gamma^2240 is
+// more than 2^64, so the buckets are a fixed array. We also keep a
+// min-heap of the largest files.
+//
+// Everything is additive, so each thread has a histogram of its own,
+// and we merge them at the end. Saved histograms from other runs, or
+// other hosts, are merged the same way.
+#define ALPHA 0.01
+#define LNGAMMA log((1 + ALPHA) / (1 - ALPHA)) // gcc folds it to a constant
+#define NLOG2 65
+#define NSKETCH 2240
+#define HIST_MAGIC "filesize-hist 1"
+
+struct topfile {
+    unsigned long long size;
+    char *path;
+};
+
+struct hist {
+    unsigned long long count, bytes, max;
+    unsigned long long log2count[NLOG2], log2bytes[NLOG2];
+    unsigned long long zero, sketch[NSKETCH];
+    struct topfile *top; // A min-heap of g_ntop files
+    size_t ntop;
+    struct hist *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct hist *all;
+} hists = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static __thread struct hist *t_hist;
+
+static struct hist *hist_new(void)
+{
+    struct hist *h;
+
+    if ((h = calloc(1, sizeof *h)) == NULL || (h->top = calloc(g_ntop + 1, sizeof *h->top)) == NULL)
+        die("Out of memory\n");
+
+    return h;
+}
+
+static struct hist *my_hist(void)
+{
+    if (t_hist == NULL) {
+        t_hist = hist_new();
+        pthread_mutex_lock(&hists.lock);
+        t_hist->next = hists.all;
+        hists.all = t_hist;
+        pthread_mutex_unlock(&hists.lock);
+    }
+
+    return t_hist;
+}
+
+static int log2bucket(unsigned long long size)
+{
+    return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+static int sketchbucket(unsigned long long size)
+{
+    int i = (int)ceil(log((double)size) / LNGAMMA);
+
+    return i < 0 ? 0 : i >= NSKETCH ? NSKETCH - 1 : i;
+}
+
+static void top_swap(struct topfile *a, struct topfile *b)
+{
+    struct topfile tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+// Add a file to the heap if it's among the largest. We own path.
+static void top_add(struct hist *h, unsigned long long size, char *path)
+{
+    size_t i, child;
+
+    if (h->ntop == g_ntop) {
+        if (g_ntop == 0 || size <= h->top[0].size) {
+            free(path);
+            return;
+        }
+
+        // Replace the smallest, and sift it down.
+        free(h->top[0].path);
+        h->top[0].size = size;
+        h->top[0].path = path;
+        for (i = 0; (child = 2 * i + 1) < h->ntop; i = child) {
+            if (child + 1 < h->ntop && h->top[child + 1].size < h->top[child].size)
+                child++;
+            if (h->top[i].size <= h->top[child].size)
+                break;
+            top_swap(&h->top[i], &h->top[child]);
+        }
+
+        return;
+    }
+
+    i = h->ntop++;
+    h->top[i].size = size;
+    h->top[i].path = path;
+    for (; i > 0 && h->top[(i - 1) / 2].size > h->top[i].size; i = (i - 1) / 2)
+        top_swap(&h->top[i], &h->top[(i - 1) / 2]);
+}
+
+static bool top_wants(const struct hist *h, unsigned long long size)
+{
+    return h->ntop < g_ntop || (g_ntop > 0 && size > h->top[0].size);
+}
+
+// path is dir/name, or name if dir is NULL. We only build it for the
+// files which go in the heap.
+static void hist_add(unsigned long long size, const char *dir, const char *name)
+{
+    struct hist *h;
+    char *path;
+    int i;
+
+    if (!g_hist)
+        return;
+
+    h = my_hist();
+    h->count++;
+    h->bytes += size;
+    if (size > h->max)
+        h->max = size;
+
+    i = log2bucket(size);
+    h->log2count[i]++;
+    h->log2bytes[i] += size;
+
+    if (size == 0)
+        h->zero++;
     else
-        printf("%10.02g%s\n", 1.0 * g_size / g_factor, suffix);
+        h->sketch[sketchbucket(size)]++;
+
+    if (top_wants(h, size)) {
+        if (dir == NULL)
+            path = strdup(name);
+        else if (asprintf(&path, "%s/%s", dir, name) == -1)
+            path = NULL;
+
+        if (path == NULL)
+            die("Out of memory\n");
+
+        top_add(h, size, path);
+    }
+}
+
+static void hist_merge(struct hist *dst, struct hist *src)
+{
+    size_t i;
+
+    dst->count += src->count;
+    dst->bytes += src->bytes;
+    if (src->max > dst->max)
+        dst->max = src->max;
+
+    for (i = 0; i < NLOG2; i++) {
+        dst->log2count[i] += src->log2count[i];
+        dst->log2bytes[i] += src->log2bytes[i];
+    }
+
+    dst->zero += src->zero;
+    for (i = 0; i < NSKETCH; i++)
+        dst->sketch[i] += src->sketch[i];
+
+    for (i = 0; i < src->ntop; i++)
+        top_add(dst, src->top[i].size, src->top[i].path);
+
+    src->ntop = 0;
+}
+
+static unsigned long long hist_quantile(const struct hist *h, double q)
+{
+    double gamma = (1 + ALPHA) / (1 - ALPHA), value;
+    unsigned long long rank, n;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    rank = (unsigned long long)(q * (h->count - 1));
+    if (rank < h->zero)
+        return 0;
+
+    n = h->zero;
+    for (i = 0; i < NSKETCH; i++) {
+        n += h->sketch[i];
+        if (n > rank)
+            break;
+    }
+
+    // The middle of the bucket, in relative terms.
+    value = 2 * pow(gamma, i) / (gamma + 1);
+    return value > h->max ? h->max : (unsigned long long)(value + 0.5);
+}
+
+static int cmp_top(const void *a, const void *b)
+{
+    const struct topfile *ta = a, *tb = b;
+
+    return ta->size < tb->size ? 1 : ta->size > tb->size ? -1 : strcmp(ta->path, tb->path);
+}
+
+static void hist_print(struct hist *h)
+{
+    static const struct {
+        const char *name;
+        double q;
+    } quantiles[] = { { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 } };
+    size_t i;
+
+    printf("\n%-24s %12s %20s\n", "size", "files", "bytes");
+    for (i = 0; i < NLOG2; i++) {
+        char range[64];
+
+        if (h->log2count[i] == 0)
+            continue;
+
+        if (i == 0)
+            snprintf(range, sizeof range, "0");
+        else
+            snprintf(range, sizeof range, "%llu-%llu", 1ULL << (i - 1), (1ULL << (i - 1)) * 2 - 1);
+
+        printf("%-24s %12llu %20llu\n", range, h->log2count[i], h->log2bytes[i]);
+    }
+
+    printf("\nfiles %llu\n", h->count);
+    for (i = 0; i < sizeof quantiles / sizeof *quantiles; i++) {
+        printf("%s ", quantiles[i].name);
+        printvalue(hist_quantile(h, quantiles[i].q));
+        putchar('\n');
+    }
+
+    printf("max ");
+    printvalue(h->max);
+    putchar('\n');
+
+    if (h->ntop > 0) {
+        qsort(h->top, h->ntop, sizeof *h->top, cmp_top);
+        printf("\nlargest files\n");
+        for (i = 0; i < h->ntop; i++) {
+            printvalue(h->top[i].size);
+            printf("\t%s\n", h->top[i].path);
+        }
+    }
+}
+
+// The saved format is text, one value per line, and only nonzero
+// buckets. Paths are last on their lines, so they may have spaces.
+static void hist_save(const struct hist *h, const char *filename)
+{
+    FILE *f;
+    size_t i;
+
+    if ((f = fopen(filename, "w")) == NULL)
+        die("%s: %s\n", filename, strerror(errno));
+
+    fprintf(f, "%s\nalpha %g\ncount %llu\nbytes %llu\nmax %llu\nzero %llu\n",
+        HIST_MAGIC, ALPHA, h->count, h->bytes, h->max, h->zero);
+
+    for (i = 0; i < NLOG2; i++) {
+        if (h->log2count[i] != 0)
+            fprintf(f, "log2 %zu %llu %llu\n", i, h->log2count[i], h->log2bytes[i]);
+    }
+
+    for (i = 0; i < NSKETCH; i++) {
+        if (h->sketch[i] != 0)
+            fprintf(f, "sketch %zu %llu\n", i, h->sketch[i]);
+    }
+
+    for (i = 0; i < h->ntop; i++)
+        fprintf(f, "top %llu %s\n", h->top[i].size, h->top[i].path);
+
+    if (fclose(f) == EOF)
+        die("%s: %s\n", filename, strerror(errno));
+}
+
+static void hist_load(struct hist *h, const char *filename)
+{
+    unsigned long long a, b;
+    char line[10240], *path;
+    double alpha;
+    size_t i;
+    FILE *f;
+    int n;
+
+    if ((f = fopen(filename, "r")) == NULL)
+        die("%s: %s\n", filename, strerror(errno));
+
+    if (fgets(line, sizeof line, f) == NULL || strcmp(line, HIST_MAGIC "\n") != 0
+    || fscanf(f, "alpha %lg\n", &alpha) != 1 || alpha != ALPHA)
+        die("%s: Not a histogram saved by this version of filesize\n", filename);
+
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "count %llu", &a) == 1)
+            h->count += a;
+        else if (sscanf(line, "bytes %llu", &a) == 1)
+            h->bytes += a;
+        else if (sscanf(line, "max %llu", &a) == 1)
+            h->max = a > h->max ? a : h->max;
+        else if (sscanf(line, "zero %llu", &a) == 1)
+            h->zero += a;
+        else if (sscanf(line, "log2 %zu %llu %llu", &i, &a, &b) == 3 && i < NLOG2) {
+            h->log2count[i] += a;
+            h->log2bytes[i] += b;
+        }
+        else if (sscanf(line, "sketch %zu %llu", &i, &a) == 2 && i < NSKETCH)
+            h->sketch[i] += a;
+        else if (sscanf(line, "top %llu %n", &a, &n) == 1) {
+            line[strcspn(line, "\n")] = '\0';
+            if ((path = strdup(line + n)) == NULL)
+                die("Out of memory\n");
+            top_add(h, a, path);
+        }
+        else
+            die("%s: Bad line: %s", filename, line);
+    }
+
+    fclose(f);
+}
+
+// Merge the threads' histograms and the --merge-hist files.
+static struct hist *mergehists(void)
+{
+    struct hist *h, *all;
+    size_t i;
+
+    if (!g_hist)
+        return NULL;
+
+    all = hist_new();
+    for (h = hists.all; h != NULL; h = h->next)
+        hist_merge(all, h);
+
+    for (i = 0; i < g_nmergehist; i++)
+        hist_load(all, g_mergehist[i]);
+
+    return all;
+}
+
+static void printhist(struct hist *all)
+{
+    if (all == NULL)
+        return;
+
+    if (g_savehist != NULL)
+        hist_save(all, g_savehist);
+
+    hist_print(all);
+}
+
+// Directories are walked by a pool of threads. Directories waiting to
+// be read are kept on a stack, so we go depth first and the stack stays
+// small. Each thread reads a directory with fstatat(), sums what's in
+// it, and pushes its subdirectories.
+//
+// We print a record for each directory down to g_maxdepth. Directories
+// below that are added to the record of their closest ancestor with one.
+// A record only has its own directory's files until the walk is done.
+// Then we add each record to its parent's. Records are created after
+// their parents, so we do that backwards.
+#define NO_RECORD SIZE_MAX
+
+struct record {
+    char *path;
+    size_t parent;
+    unsigned long long apparent;  // st_size
+    unsigned long long allocated; // st_blocks * 512
+    bool walked;                  // we managed to open it
+};
+
+struct work {
+    char *path;
+    size_t record; // The record we add to
+    int depth;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct work *stack;
+    size_t nstack, maxstack;
+    size_t busy; // Directories on the stack or being read
+    struct record *records;
+    size_t nrecords, maxrecords;
+} walk = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// Files with more than one link go in a set of (dev, ino), and are only
+// counted the first time we see them. Most files have one link, so the
+// lock is rarely taken.
+struct inode {
+    dev_t dev;
+    ino_t ino;
+    bool used;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct inode *slots;
+    size_t nslots, n; // nslots is a power of two
+} links = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static size_t hash_inode(dev_t dev, ino_t ino)
+{
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+
+    h *= 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 32);
+}
+
+static struct inode *find_inode(dev_t dev, ino_t ino)
+{
+    size_t i = hash_inode(dev, ino) & (links.nslots - 1);
+
+    while (links.slots[i].used && (links.slots[i].dev != dev || links.slots[i].ino != ino))
+        i = (i + 1) & (links.nslots - 1);
+
+    return &links.slots[i];
+}
+
+// Returns true if we've seen the file before, under another name.
+static bool seen_before(const struct stat *st)
+{
+    struct inode *old, *slot;
+    size_t i, nold;
+    bool seen;
+
+    if (st->st_nlink < 2 || S_ISDIR(st->st_mode))
+        return false;
+
+    pthread_mutex_lock(&links.lock);
+    if ((links.n + 1) * 4 > links.nslots * 3) {
+        old = links.slots;
+        nold = links.nslots;
+        links.nslots = nold == 0 ? 4096 : nold * 2;
+        if ((links.slots = calloc(links.nslots, sizeof *links.slots)) == NULL)
+            die("Out of memory\n");
+
+        for (i = 0; i < nold; i++) {
+            if (old[i].used)
+                *find_inode(old[i].dev, old[i].ino) = old[i];
+        }
+
+        free(old);
+    }
+
+    slot = find_inode(st->st_dev, st->st_ino);
+    seen = slot->used;
+    if (!seen) {
+        slot->dev = st->st_dev;
+        slot->ino = st->st_ino;
+        slot->used = true;
+        links.n++;
+    }
+
+    pthread_mutex_unlock(&links.lock);
+    return seen;
+}
+
+// Call with walk.lock held.
+static size_t add_record(const char *path, size_t parent)
+{
+    struct record *tmp;
+
+    if (walk.nrecords == walk.maxrecords) {
+        walk.maxrecords = walk.maxrecords == 0 ? 1024 : walk.maxrecords * 2;
+        if ((tmp = realloc(walk.records, walk.maxrecords * sizeof *tmp)) == NULL)
+            die("Out of memory\n");
+
+        walk.records = tmp;
+    }
+
+    tmp = &walk.records[walk.nrecords];
+    if ((tmp->path = strdup(path)) == NULL)
+        die("Out of memory\n");
+
+    tmp->parent = parent;
+    tmp->apparent = tmp->allocated = 0;
+    tmp->walked = false;
+    return walk.nrecords++;
+}
+
+// Call with walk.lock held. We own path now.
+static void push_dir(char *path, size_t record, int depth)
+{
+    struct work *tmp;
+
+    if (walk.nstack == walk.maxstack) {
+        walk.maxstack = walk.maxstack == 0 ? 1024 : walk.maxstack * 2;
+        if ((tmp = realloc(walk.stack, walk.maxstack * sizeof *tmp)) == NULL)
+            die("Out of memory\n");
+
+        walk.stack = tmp;
+    }
+
+    walk.stack[walk.nstack].path = path;
+    walk.stack[walk.nstack].record = record;
+    walk.stack[walk.nstack].depth = depth;
+    walk.nstack++;
+    walk.busy++;
+    pthread_cond_signal(&walk.cond);
+}
+
+static void read_dir(const struct work *w)
+{
+    unsigned long long apparent = 0, allocated = 0;
+    struct dirent *de;
+    struct stat st;
+    size_t record;
+    char *path;
+    DIR *d;
+    int fd, flags;
+
+    // Arguments were stat()ed, so a symlink to a directory is walked like
+    // the directory. Below that, entries come from fstatat() with
+    // AT_SYMLINK_NOFOLLOW, and a symlink here means the tree changed.
+    flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (w->depth > 0)
+        flags |= O_NOFOLLOW;
+
+    fd = open(w->path, flags);
+    if (fd == -1 || (d = fdopendir(fd)) == NULL || fstat(fd, &st) == -1) {
+        warning("%s: %s\n", w->path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    // A directory only counts once we know we can walk it.
+    apparent += st.st_size;
+    allocated += st.st_blocks * 512ULL;
+
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            warning("%s/%s: %s\n", w->path, de->d_name, strerror(errno));
+            continue;
+        }
+
+        if (seen_before(&st))
+            continue;
+
+        if (!S_ISDIR(st.st_mode)) {
+            apparent += st.st_size;
+            allocated += st.st_blocks * 512ULL;
+            if (S_ISREG(st.st_mode))
+                hist_add(st.st_size, w->path, de->d_name);
+            continue;
+        }
+
+        if (asprintf(&path, "%s/%s", w->path, de->d_name) == -1)
+            die("Out of memory\n");
+
+        // The directory gets its own record, if it is shallow enough.
+        pthread_mutex_lock(&walk.lock);
+        record = w->record;
+        if (w->depth < g_maxdepth)
+            record = add_record(path, w->record);
+
+        push_dir(path, record, w->depth + 1);
+        pthread_mutex_unlock(&walk.lock);
+    }
+
+    closedir(d);
+
+    pthread_mutex_lock(&walk.lock);
+    walk.records[w->record].apparent += apparent;
+    walk.records[w->record].allocated += allocated;
+    if (w->depth <= g_maxdepth)
+        walk.records[w->record].walked = true;
+    pthread_mutex_unlock(&walk.lock);
+}
+
+static void *walker(void *arg)
+{
+    struct work w;
+
+    (void)arg;
+    pthread_mutex_lock(&walk.lock);
+    for (;;) {
+        while (walk.nstack == 0 && walk.busy > 0)
+            pthread_cond_wait(&walk.cond, &walk.lock);
+
+        // Nothing on the stack, and no one to put anything there.
+        if (walk.nstack == 0)
+            break;
+
+        w = walk.stack[--walk.nstack];
+        pthread_mutex_unlock(&walk.lock);
+        read_dir(&w);
+        free(w.path);
+        pthread_mutex_lock(&walk.lock);
+
+        if (--walk.busy == 0)
+            pthread_cond_broadcast(&walk.cond);
+    }
+
+    pthread_mutex_unlock(&walk.lock);
+    return NULL;
+}
+
+static void adddir(const char *path)
+{
+    size_t record;
+    char *copy;
+
+    if ((copy = strdup(path)) == NULL)
+        die("Out of memory\n");
+
+    pthread_mutex_lock(&walk.lock);
+    record = add_record(path, NO_RECORD);
+    push_dir(copy, record, 0);
+    g_walked = true;
+    pthread_mutex_unlock(&walk.lock);
+}
+
+static long nthreads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+
+    if (g_nthreads > 0)
+        return g_nthreads;
+
+    return n < 8 ? 8 : n;
+}
+
+static int cmp_records(const void *a, const void *b)
+{
+    const struct record *ra = a, *rb = b;
+
+    return strcmp(ra->path, rb->path);
+}
+
+// Walk the directories added so far, and print their records.
+static void walkdirs(void)
+{
+    pthread_t *threads;
+    long i, n;
+
+    if (walk.nstack == 0)
+        return;
+
+    n = nthreads();
+    if ((threads = calloc(n, sizeof *threads)) == NULL)
+        die("Out of memory\n");
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, walker, NULL) != 0)
+            break;
+    }
+
+    if (i == 0)
+        die("Could not start any threads\n");
+
+    n = i;
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+
+    for (i = walk.nrecords - 1; i >= 0; i--) {
+        struct record *r = &walk.records[i];
+
+        if (r->parent != NO_RECORD) {
+            walk.records[r->parent].apparent += r->apparent;
+            walk.records[r->parent].allocated += r->allocated;
+        }
+        else {
+            g_size += r->apparent;
+            g_allocated += r->allocated;
+        }
+    }
+
+    qsort(walk.records, walk.nrecords, sizeof *walk.records, cmp_records);
+    for (i = 0; i < (long)walk.nrecords; i++) {
+        // Directories we could not open were reported already.
+        if (!walk.records[i].walked) {
+            free(walk.records[i].path);
+            continue;
+        }
+
+        printvalue(walk.records[i].apparent);
+        putchar('\t');
+        printvalue(walk.records[i].allocated);
+        printf("\t%s\n", walk.records[i].path);
+        free(walk.records[i].path);
+    }
+
+    free(walk.records);
+    free(walk.stack);
+    free(links.slots);
 }
 
 static void rtrim(char *s)
@@ -114,8 +915,15 @@ static void addsize(const char *path)
     rtrim(s);
     if (stat(s, &st))
         perror(s);
-    else if ((st.st_mode & S_IFMT) == S_IFREG)
-        g_size += st.st_size;
+    else if (S_ISDIR(st.st_mode))
+        adddir(s);
+    else if ((st.st_mode & S_IFMT) == S_IFREG) {
+        if (!seen_before(&st)) {
+            g_size += st.st_size;
+            g_allocated += st.st_blocks * 512ULL;
+            hist_add(st.st_size, NULL, s);
+        }
+    }
     else
         warning("%s: not a regular file\n", s);
 
@@ -124,24 +932,255 @@ static void addsize(const char *path)
 }
 
 
-int main(int argc, char *argv[])
+// Paths on stdin are read in blocks, and each block with complete lines
+// is a batch. A pool of threads takes batches, splits them into paths in
+// place, and calls statx() for each path. Many stats are in flight at
+// once, which is what network file systems need. We'd rather use
+// io_uring for that, but don't want the dependency, and threads are
+// almost as good when each stat waits for the server anyway.
+#define BATCH_SIZE (64 * 1024)
+#define MAX_BATCHES 64 // Batches waiting for a thread
+
+struct batch {
+    char *buf;
+    size_t len;
+    struct batch *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct batch *head, *tail;
+    size_t n;
+    bool eof;
+} queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+struct sums {
+    unsigned long long size, allocated;
+};
+
+static void add_batch(char *buf, size_t len)
 {
+    struct batch *b;
 
-    parse_commandline(argc, argv);
+    if ((b = malloc(sizeof *b)) == NULL)
+        die("Out of memory\n");
+
+    b->buf = buf;
+    b->len = len;
+    b->next = NULL;
+
+    pthread_mutex_lock(&queue.lock);
+    while (queue.n == MAX_BATCHES)
+        pthread_cond_wait(&queue.cond, &queue.lock);
+
+    if (queue.tail != NULL)
+        queue.tail->next = b;
+    else
+        queue.head = b;
+
+    queue.tail = b;
+    queue.n++;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+}
 
-    if (optind == argc) {
-        char path[10240];
-        while (fgets(path, sizeof path, stdin) != NULL) {
-            addsize(path);
+static void statpath(const char *path, struct sums *sums)
+{
+    struct statx stx;
+    struct stat st;
+
+    if (statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_INO
+        | STATX_SIZE | STATX_BLOCKS, &stx) == -1) {
+        warning("%s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    // seen_before() and adddir() want a struct stat.
+    memset(&st, 0, sizeof st);
+    st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    st.st_ino = stx.stx_ino;
+    st.st_mode = stx.stx_mode;
+    st.st_nlink = stx.stx_nlink;
+    st.st_size = stx.stx_size;
+    st.st_blocks = stx.stx_blocks;
+
+    if (S_ISDIR(st.st_mode))
+        adddir(path);
+    else if (!S_ISREG(st.st_mode))
+        warning("%s: not a regular file\n", path);
+    else if (!seen_before(&st)) {
+        sums->size += st.st_size;
+        sums->allocated += st.st_blocks * 512ULL;
+        hist_add(st.st_size, NULL, path);
+    }
+}
+
+// buf has room for a NUL after len bytes, so the last path can be
+// terminated like the others.
+static void stat_batch(char *buf, size_t len, struct sums *sums)
+{
+    char *p = buf, *q, *end = buf + len;
+
+    while (p < end) {
+        if ((q = memchr(p, g_delim, end - p)) == NULL)
+            q = end;
+
+        *q = '\0';
+        if (g_delim == '\n') {
+            char *e = q;
+
+            while (e > p && isspace((unsigned char)e[-1]))
+                *--e = '\0';
         }
+
+        if (*p != '\0')
+            statpath(p, sums);
+
+        p = q + 1;
     }
+}
+
+static void *stat_worker(void *arg)
+{
+    struct sums *sums = arg;
+    struct batch *b;
+
+    for (;;) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.head == NULL && !queue.eof)
+            pthread_cond_wait(&queue.cond, &queue.lock);
+
+        if ((b = queue.head) != NULL) {
+            if ((queue.head = b->next) == NULL)
+                queue.tail = NULL;
+
+            queue.n--;
+            pthread_cond_broadcast(&queue.cond);
+        }
+
+        pthread_mutex_unlock(&queue.lock);
+        if (b == NULL)
+            break;
+
+        stat_batch(b->buf, b->len, sums);
+        free(b->buf);
+        free(b);
+    }
+
+    return NULL;
+}
+
+// Read paths from fd and stat them on a pool of threads. A batch ends
+// with the last delimiter in the block. The partial path after it
+// starts the next block, and is the only thing we copy. A path longer
+// than a block makes the block grow.
+static void addpaths(int fd)
+{
+    size_t size = BATCH_SIZE, used = 0, rest;
+    struct sums *sums;
+    pthread_t *threads;
+    char *buf, *next, *end;
+    ssize_t nread;
+    long i, n;
+
+    n = nthreads();
+    if ((threads = calloc(n, sizeof *threads)) == NULL || (sums = calloc(n, sizeof *sums)) == NULL)
+        die("Out of memory\n");
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, stat_worker, &sums[i]) != 0)
+            break;
+    }
+
+    if (i == 0)
+        die("Could not start any threads\n");
+
+    n = i;
+    if ((buf = malloc(size + 1)) == NULL)
+        die("Out of memory\n");
+
+    for (;;) {
+        // Fill the block, as pipes give us a little at a time.
+        while (used < size && (nread = read(fd, buf + used, size - used)) != 0) {
+            if (nread == -1) {
+                if (errno == EINTR)
+                    continue;
+
+                die("stdin: %s\n", strerror(errno));
+            }
+
+            used += nread;
+        }
+
+        if (used < size) {
+            if (used > 0)
+                add_batch(buf, used);
+            else
+                free(buf);
+            break;
+        }
+
+        if ((end = memrchr(buf, g_delim, used)) == NULL) {
+            size *= 2;
+            if ((buf = realloc(buf, size + 1)) == NULL)
+                die("Out of memory\n");
+            continue;
+        }
+
+        end++;
+        rest = used - (end - buf);
+        size = BATCH_SIZE > rest * 2 ? BATCH_SIZE : rest * 2;
+        if ((next = malloc(size + 1)) == NULL)
+            die("Out of memory\n");
+
+        memcpy(next, end, rest);
+        add_batch(buf, end - buf);
+        buf = next;
+        used = rest;
+    }
+
+    pthread_mutex_lock(&queue.lock);
+    queue.eof = true;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        g_size += sums[i].size;
+        g_allocated += sums[i].allocated;
+    }
+
+    free(threads);
+    free(sums);
+}
+
+int main(int argc, char *argv[])
+{
+    struct hist *all;
+    bool onlyhist;
+
+    parse_commandline(argc, argv);
+
+    onlyhist = optind == argc && g_nmergehist > 0;
+    if (optind == argc && g_nmergehist == 0)
+        addpaths(STDIN_FILENO);
     else {
         while (argv[optind] != NULL) {
             addsize(argv[optind++]);
         }
     }
 
+    walkdirs();
+    all = mergehists();
+
+    // With only --merge-hist, the files we report are those in the
+    // saved histograms.
+    if (onlyhist)
+        g_size = all->bytes;
+
     printsize();
+    printhist(all);
 
 
     exit(0);
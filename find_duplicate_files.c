@@ -3,28 +3,43 @@
  */
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fnmatch.h>
 #include <ftw.h>
 #include <gcrypt.h>
+#include <getopt.h>
+#include <time.h>
 
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
 int ftw_flags = FTW_ACTIONRETVAL | FTW_STOP | FTW_PHYS;
 int verbose = 0;
 int debug = 0;
 int silent = 0; // print error messages? (Some will always be printed)
+int reflinks = 0; // Group files with identical shared extents before hashing?
 
 const char *master = NULL;
 
 static const char *ignores[200];
 static size_t nignores;
 
+// Files matching these patterns are hashed with normalized line endings
+// and without trailing whitespace. See -n.
+static const char *normalize[200];
+static size_t nnormalize;
+
 // We store the directories to traverse in an array.
 const char *searchdirs[10240];
 size_t nsearchdirs = 0;
@@ -32,8 +47,10 @@ size_t nsearchdirs = 0;
 // We store paths and hash values in structs like this:
 struct entry {
     char *fpath;
+    off_t size;
     char *hash4k;
     char *fullhash;
+    char *extents; // Extent map, if the file shares extents. See -r.
 };
 struct entry *entries = NULL;
 size_t nentries_max = 0; // How many have we allocated room for?
@@ -41,6 +58,35 @@ size_t nentries_used = 0; // How many has been used?
 
 size_t initial_nentries = 300000; // We start off supporting that many entries
 
+// Statistics, see --stats and --progress. Phases are the steps main()
+// goes through, tiers are the hash passes a file may go through.
+enum phase { PH_TRAVERSE, PH_REFLINKS, PH_SORT_4K, PH_HASH_FULL, PH_SORT_FULL, PH_OUTPUT, NPHASES };
+enum tier { TIER_4K, TIER_FULL, NTIERS };
+enum syscall { SC_OPEN, SC_CLOSE, SC_FSTAT, SC_MMAP, SC_MUNMAP, SC_READ, SC_IOCTL, NSYSCALLS };
+
+static const char *phase_names[NPHASES] = {
+    "traverse", "reflinks", "sort_4k", "hash_full", "sort_full", "output"
+};
+static const char *tier_names[NTIERS] = { "4k", "full" };
+static const char *syscall_names[NSYSCALLS] = {
+    "open", "close", "fstat", "mmap", "munmap", "read", "ioctl"
+};
+
+static struct {
+    double wall[NPHASES], cpu[NPHASES];
+    unsigned long files[NTIERS];          // Files hashed per tier
+    unsigned long long bytes[NTIERS];     // Bytes read per tier
+    unsigned long eliminated[NTIERS];     // Files proven unique per tier
+    unsigned long syscalls[NSYSCALLS];
+    unsigned long visited;                // Objects reported by nftw()
+    unsigned long shared;                 // Files skipped due to -r
+    unsigned long duplicates;             // Pairs reported
+} stats;
+
+static enum phase current_phase;
+static const char *stats_format = NULL;   // NULL, "text" or "json"
+static FILE *progress_file = NULL;
+
 static void free_allocated_mem(void)
 {
     size_t i;
@@ -50,13 +96,14 @@ static void free_allocated_mem(void)
             free(entries[i].fullhash);
 
         free(entries[i].hash4k);
+        free(entries[i].extents);
         free(entries[i].fpath);
     }
 
     free(entries);
 }
 
-static void add_entry(const char *fpath, char *hash4k)
+static void add_entry(const char *fpath, off_t size, char *hash4k)
 {
     size_t cb;
 
@@ -83,7 +130,7 @@ static void add_entry(const char *fpath, char *hash4k)
         }
         entries = tmp;
         nentries_max *= 2;
-        memset(&entries[old_size], 0, new_size - old_size);
+        memset((char *)entries + old_size, 0, new_size - old_size);
     }
 
     // Add element. Note that we create a copy of fpath, but *NOT* of
@@ -93,6 +140,9 @@ static void add_entry(const char *fpath, char *hash4k)
         exit(EXIT_FAILURE);
     }
 
+    entries[nentries_used].size = size;
+    entries[nentries_used].fullhash = NULL;
+    entries[nentries_used].extents = NULL;
     entries[nentries_used++].hash4k = hash4k;
 }
 
@@ -110,6 +160,13 @@ static void show_usage(void)
         "-s silent. Don't print (most) error messages.",
         "-m directory. Treat dir as a master directory, not deleting anything from it or its subdirs",
         "-d debug. Print misc debugging info.",
+        "-n pattern. Hash files matching pattern as text, ignoring CRLF vs LF",
+        "   and trailing whitespace. May be repeated, e.g. -n '*.c' -n '*.h'",
+        "-r Reflinks. Files with identical shared extents are reported as",
+        "   already deduplicated, and only one of them is hashed.",
+        "--stats[=text|json] Print time, I/O and elimination counts per phase",
+        "   and hash tier to stderr when done.",
+        "--progress[=file] Print a progress line every second to stderr or file.",
         "",
     };
 
@@ -166,29 +223,88 @@ static inline bool in_ignores(const char *val)
     return false;
 }
 
+static inline void add_normalize(const char *val)
+{
+    static const size_t avail = sizeof normalize / sizeof *normalize;
+    if (nnormalize == avail) {
+        fprintf(stderr, "Too many -n arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    normalize[nnormalize++] = val;
+}
+
+// Patterns with a slash are matched against the full path,
+// other patterns are matched against the file name only.
+static inline bool in_normalize(const char *fpath)
+{
+    const char *fname = strrchr(fpath, '/');
+    size_t i;
+
+    fname = fname == NULL ? fpath : fname + 1;
+    for (i = 0; i < nnormalize; i++) {
+        if (strchr(normalize[i], '/') != NULL) {
+            if (fnmatch(normalize[i], fpath, FNM_PATHNAME) == 0)
+                return true;
+        }
+        else if (fnmatch(normalize[i], fname, 0) == 0)
+            return true;
+    }
+
+    return false;
+}
+
 static void parse_command_line(int argc, char *argv[])
 {
     int c;
     extern char *optarg;
     extern int optind;
 
-    const char *options = "vhxdsm:i:";
+    const char *options = "vhxdsrm:i:n:";
+    static const struct option longopts[] = {
+        { "stats", optional_argument, NULL, 'S' },
+        { "progress", optional_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
 
     if (argc == 1) {
         show_usage();
         exit(EXIT_FAILURE);
     }
 
-    while ((c = getopt(argc, argv, options)) != -1) {
+    while ((c = getopt_long(argc, argv, options, longopts, NULL)) != -1) {
         switch (c) {
             case 'h':
                 show_usage();
                 exit(EXIT_SUCCESS);
 
+            case 'S':
+                stats_format = optarg == NULL ? "text" : optarg;
+                if (strcmp(stats_format, "text") != 0 && strcmp(stats_format, "json") != 0) {
+                    fprintf(stderr, "error: --stats must be text or json\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'P':
+                if (optarg == NULL)
+                    progress_file = stderr;
+                else if ((progress_file = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    exit(EXIT_FAILURE);
+                }
+                else
+                    setvbuf(progress_file, NULL, _IOLBF, 0);
+                break;
+
             case 'i':
                 add_ignore(optarg);
                 break;
 
+            case 'n':
+                add_normalize(optarg);
+                break;
+
             case 'm':
                 master = optarg;
                 break;
@@ -201,6 +317,10 @@ static void parse_command_line(int argc, char *argv[])
                 debug = 1;
                 break;
 
+            case 'r':
+                reflinks = 1;
+                break;
+
             case 'v':
                 verbose = 1;
                 break;
@@ -242,26 +362,307 @@ static void parse_command_line(int argc, char *argv[])
     }
 }
 
+static double seconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void begin_phase(enum phase ph)
+{
+    current_phase = ph;
+    stats.wall[ph] -= seconds(CLOCK_MONOTONIC);
+    stats.cpu[ph] -= seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void end_phase(enum phase ph)
+{
+    stats.wall[ph] += seconds(CLOCK_MONOTONIC);
+    stats.cpu[ph] += seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// Called once per file. The coarse clock is cheap enough for that.
+static void progress(void)
+{
+    static double start, last;
+    double now;
+
+    if (progress_file == NULL)
+        return;
+
+    now = seconds(CLOCK_MONOTONIC_COARSE);
+    if (start == 0)
+        start = last = now;
+
+    if (now - last < 1.0)
+        return;
+
+    last = now;
+    fprintf(progress_file, "progress elapsed=%.1f phase=%s visited=%lu entries=%zu "
+        "files_4k=%lu bytes_4k=%llu files_full=%lu bytes_full=%llu\n",
+        now - start, phase_names[current_phase], stats.visited, nentries_used,
+        stats.files[TIER_4K], stats.bytes[TIER_4K],
+        stats.files[TIER_FULL], stats.bytes[TIER_FULL]);
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1)
+        return 0;
+
+    return ru.ru_maxrss;
+}
+
+static void print_stats_text(void)
+{
+    double wall = 0, cpu = 0, hashtime;
+    unsigned long long bytes = stats.bytes[TIER_4K] + stats.bytes[TIER_FULL];
+    size_t i;
+
+    fprintf(stderr, "%-12s %10s %10s\n", "phase", "wall(s)", "cpu(s)");
+    for (i = 0; i < NPHASES; i++) {
+        fprintf(stderr, "%-12s %10.3f %10.3f\n", phase_names[i], stats.wall[i], stats.cpu[i]);
+        wall += stats.wall[i];
+        cpu += stats.cpu[i];
+    }
+    fprintf(stderr, "%-12s %10.3f %10.3f\n\n", "total", wall, cpu);
+
+    fprintf(stderr, "%-12s %10s %14s %10s\n", "tier", "files", "bytes", "eliminated");
+    for (i = 0; i < NTIERS; i++)
+        fprintf(stderr, "%-12s %10lu %14llu %10lu\n", tier_names[i],
+            stats.files[i], stats.bytes[i], stats.eliminated[i]);
+    fprintf(stderr, "\n");
+
+    fprintf(stderr, "syscalls:");
+    for (i = 0; i < NSYSCALLS; i++)
+        fprintf(stderr, " %s=%lu", syscall_names[i], stats.syscalls[i]);
+    fprintf(stderr, "\n");
+
+    // Hashing happens while traversing too, not just in the hash phase.
+    hashtime = stats.wall[PH_TRAVERSE] + stats.wall[PH_REFLINKS] + stats.wall[PH_HASH_FULL];
+    fprintf(stderr, "visited: %lu\nshared: %lu\nduplicates: %lu\n",
+        stats.visited, stats.shared, stats.duplicates);
+    fprintf(stderr, "peak rss: %ld KB\n", peak_rss_kb());
+    fprintf(stderr, "throughput: %.1f MB/s\n", hashtime > 0 ? bytes / hashtime / 1e6 : 0.0);
+}
+
+static void print_stats_json(void)
+{
+    double hashtime;
+    unsigned long long bytes = stats.bytes[TIER_4K] + stats.bytes[TIER_FULL];
+    size_t i;
+
+    fprintf(stderr, "{\n  \"phases\": {");
+    for (i = 0; i < NPHASES; i++)
+        fprintf(stderr, "%s\n    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }",
+            i > 0 ? "," : "", phase_names[i], stats.wall[i], stats.cpu[i]);
+
+    fprintf(stderr, "\n  },\n  \"tiers\": {");
+    for (i = 0; i < NTIERS; i++)
+        fprintf(stderr, "%s\n    \"%s\": { \"files\": %lu, \"bytes\": %llu, \"eliminated\": %lu }",
+            i > 0 ? "," : "", tier_names[i], stats.files[i], stats.bytes[i], stats.eliminated[i]);
+
+    fprintf(stderr, "\n  },\n  \"syscalls\": {");
+    for (i = 0; i < NSYSCALLS; i++)
+        fprintf(stderr, "%s \"%s\": %lu", i > 0 ? "," : "", syscall_names[i], stats.syscalls[i]);
+
+    hashtime = stats.wall[PH_TRAVERSE] + stats.wall[PH_REFLINKS] + stats.wall[PH_HASH_FULL];
+    fprintf(stderr, " },\n  \"visited\": %lu,\n  \"shared\": %lu,\n  \"duplicates\": %lu,\n"
+        "  \"peak_rss_kb\": %ld,\n  \"throughput_bytes_per_sec\": %.0f\n}\n",
+        stats.visited, stats.shared, stats.duplicates, peak_rss_kb(),
+        hashtime > 0 ? bytes / hashtime : 0.0);
+}
+
+static void print_stats(void)
+{
+    if (stats_format == NULL)
+        return;
+
+    if (strcmp(stats_format, "json") == 0)
+        print_stats_json();
+    else
+        print_stats_text();
+}
+
+static char *digest2string(const unsigned char *digest, size_t digestsize)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+    char *string = malloc(digestsize * 2 + 1);
+
+    if (string == NULL)
+        return NULL;
+
+    for (i = 0; i < digestsize; i++) {
+        string[i * 2] = hex[digest[i] >> 4];
+        string[i * 2 + 1] = hex[digest[i] & 0x0f];
+    }
+
+    string[i * 2] = '\0';
+    return string;
+}
+
 static char *hashbuf(const char *src, size_t srclen)
 {
     int algo = GCRY_MD_SHA1;
-    size_t digestsize = gcry_md_get_algo_dlen(algo);
-    size_t i, stringsize = digestsize * 2 + 4;
+    unsigned char digest[64];
 
-    unsigned char *digest = malloc(digestsize);
-    char *string = malloc(stringsize);
+    assert(gcry_md_get_algo_dlen(algo) <= sizeof digest);
+    gcry_md_hash_buffer(algo, digest, src, srclen);
+    return digest2string(digest, gcry_md_get_algo_dlen(algo));
+}
 
-    if (digest == NULL || string == NULL)
+// The normalizer feeds text to a hash while it reads it. CR, space and
+// tab are held back in pending until we know what follows. If it's a
+// newline or EOF, they're trailing whitespace and dropped. This turns
+// CRLF into LF too. We stop after limit bytes of normalized output,
+// so the 4K hash of two normalized files is comparable.
+struct normalizer {
+    gcry_md_hd_t md;
+    size_t limit, nout;
+    char *pending;
+    size_t npending, pendsize;
+    char out[65536]; // Hashing many short runs is slow, so we batch them.
+    size_t nbuffered;
+};
+
+static inline bool is_trailing_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static void norm_emit(struct normalizer *p, const char *src, size_t len)
+{
+    if (len > p->limit - p->nout)
+        len = p->limit - p->nout;
+
+    p->nout += len;
+    if (len > sizeof p->out - p->nbuffered) {
+        gcry_md_write(p->md, p->out, p->nbuffered);
+        p->nbuffered = 0;
+
+        if (len > sizeof p->out) {
+            gcry_md_write(p->md, src, len);
+            return;
+        }
+    }
+
+    memcpy(&p->out[p->nbuffered], src, len);
+    p->nbuffered += len;
+}
+
+static void norm_hold(struct normalizer *p, const char *src, size_t len)
+{
+    if (p->npending + len > p->pendsize) {
+        char *tmp;
+        size_t newsize = p->pendsize == 0 ? 256 : p->pendsize;
+
+        while (newsize < p->npending + len)
+            newsize *= 2;
+
+        if ((tmp = realloc(p->pending, newsize)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        p->pending = tmp;
+        p->pendsize = newsize;
+    }
+
+    memcpy(&p->pending[p->npending], src, len);
+    p->npending += len;
+}
+
+// Whitespace followed by something other than a newline in the same
+// buffer is ordinary text, so we only copy to pending at buffer ends.
+static void norm_write(struct normalizer *p, const char *src, size_t len)
+{
+    const char *end = src + len, *run = src, *ws = NULL;
+
+    for (; src < end; src++) {
+        if (is_trailing_space(*src)) {
+            if (ws == NULL)
+                ws = src;
+        }
+        else if (*src == '\n') {
+            if (ws == NULL)
+                ws = src;
+
+            p->npending = 0;
+            norm_emit(p, run, ws - run);
+            norm_emit(p, src, 1);
+            run = src + 1;
+            ws = NULL;
+        }
+        else {
+            ws = NULL;
+            if (p->npending > 0) {
+                norm_emit(p, p->pending, p->npending);
+                p->npending = 0;
+            }
+        }
+    }
+
+    if (ws == NULL)
+        norm_emit(p, run, end - run);
+    else {
+        norm_emit(p, run, ws - run);
+        norm_hold(p, ws, end - ws);
+    }
+}
+
+static char *hashfile_normalized(const char *fpath, bool fullfile)
+{
+    int algo = GCRY_MD_SHA1;
+    struct normalizer norm;
+    char buf[65536];
+    ssize_t nread = 0;
+    enum tier tier = fullfile ? TIER_FULL : TIER_4K;
+    char *string = NULL;
+    int fd;
+
+    norm.limit = fullfile ? SIZE_MAX : 4096;
+    norm.nout = norm.nbuffered = 0;
+    norm.pending = NULL;
+    norm.npending = norm.pendsize = 0;
+
+    stats.files[tier]++;
+    stats.syscalls[SC_OPEN]++;
+    if ((fd = open(fpath, O_RDONLY)) == -1) {
+        if (!silent)
+            perror(fpath);
         return NULL;
+    }
 
-    gcry_md_hash_buffer(algo, digest, src, srclen);
+    if (gcry_md_open(&norm.md, algo, 0) != 0) {
+        fprintf(stderr, "Could not create hash context\n");
+        exit(EXIT_FAILURE);
+    }
 
-    for (i = 0; i < digestsize; i++) {
-        unsigned d = (unsigned)digest[i];
-        sprintf(&string[i * 2], "%02x", d);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (norm.nout < norm.limit && (nread = read(fd, buf, sizeof buf)) > 0) {
+        stats.syscalls[SC_READ]++;
+        stats.bytes[tier] += nread;
+        norm_write(&norm, buf, (size_t)nread);
     }
 
-    free(digest);
+    if (nread == -1) {
+        if (!silent)
+            perror(fpath);
+    }
+    else {
+        gcry_md_write(norm.md, norm.out, norm.nbuffered);
+        string = digest2string(gcry_md_read(norm.md, algo), gcry_md_get_algo_dlen(algo));
+    }
+
+    gcry_md_close(norm.md);
+    free(norm.pending);
+    stats.syscalls[SC_CLOSE]++;
+    close(fd);
     return string;
 }
 
@@ -273,7 +674,11 @@ static char *hashfile(const char *fpath, bool fullfile)
     void *contents = NULL;
     size_t mapsize = 0;
 
+    if (nnormalize > 0 && in_normalize(fpath))
+        return hashfile_normalized(fpath, fullfile);
+
     // Memory map the file and hash it
+    stats.syscalls[SC_OPEN]++;
     if ((fd = open(fpath, O_RDONLY)) == -1) {
         if (!silent)
             perror(fpath);
@@ -281,6 +686,7 @@ static char *hashfile(const char *fpath, bool fullfile)
     }
 
     struct stat sb;
+    stats.syscalls[SC_FSTAT]++;
     if (fstat(fd, &sb) == -1) 
         goto err;
 
@@ -289,6 +695,8 @@ static char *hashfile(const char *fpath, bool fullfile)
     if (!fullfile && mapsize > 4096)
         mapsize = 4096;
 
+    stats.syscalls[SC_MMAP]++;
+    stats.syscalls[SC_CLOSE]++;
     contents = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
     close(fd);
     fd = -1;
@@ -299,7 +707,10 @@ static char *hashfile(const char *fpath, bool fullfile)
     }
 
     string = hashbuf(contents, mapsize);
+    stats.files[fullfile ? TIER_FULL : TIER_4K]++;
+    stats.bytes[fullfile ? TIER_FULL : TIER_4K] += mapsize;
 
+    stats.syscalls[SC_MUNMAP]++;
     munmap(contents, mapsize);
     return string;
 
@@ -317,10 +728,104 @@ err:
     return NULL;
 }
 
+// Return the file's extent map as a string, if at least one of the
+// extents is shared with another file. Two files with the same size
+// and the same extent map have the same content, since they're stored
+// in the same blocks. We return NULL if nothing is shared, or if the
+// file system can't tell us where the data is.
+static char *extent_key(const char *fpath, off_t size)
+{
+    enum { nextents = 64 };
+    struct fiemap *fm;
+    size_t cb = sizeof *fm + nextents * sizeof(struct fiemap_extent);
+    char *key = NULL, *tmp;
+    size_t keylen = 0, keysize = 0;
+    bool shared = false, last = false;
+    __u64 start = 0;
+    int fd;
+
+    stats.syscalls[SC_OPEN]++;
+    if ((fd = open(fpath, O_RDONLY)) == -1) {
+        if (!silent)
+            perror(fpath);
+        return NULL;
+    }
+
+    if ((fm = malloc(cb)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while (!last) {
+        memset(fm, 0, cb);
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = nextents;
+
+        stats.syscalls[SC_IOCTL]++;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) == -1 || fm->fm_mapped_extents == 0)
+            goto unusable;
+
+        for (__u32 i = 0; i < fm->fm_mapped_extents; i++) {
+            const struct fiemap_extent *fe = &fm->fm_extents[i];
+
+            if (fe->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))
+                goto unusable;
+
+            if (fe->fe_flags & FIEMAP_EXTENT_SHARED)
+                shared = true;
+
+            if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+                last = true;
+
+            // Room for three 64-bit hex numbers and separators
+            if (keysize - keylen < 64) {
+                keysize = keysize == 0 ? 256 : keysize * 2;
+                if ((tmp = realloc(key, keysize)) == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+                key = tmp;
+                if (keylen == 0)
+                    keylen = sprintf(key, "%llx", (unsigned long long)size);
+            }
+
+            keylen += sprintf(&key[keylen], ";%llx:%llx:%llx",
+                (unsigned long long)fe->fe_logical,
+                (unsigned long long)fe->fe_physical,
+                (unsigned long long)fe->fe_length);
+
+            start = fe->fe_logical + fe->fe_length;
+        }
+    }
+
+    free(fm);
+    stats.syscalls[SC_CLOSE]++;
+    close(fd);
+
+    if (!shared) {
+        free(key);
+        return NULL;
+    }
+
+    return key;
+
+unusable:
+    free(fm);
+    free(key);
+    stats.syscalls[SC_CLOSE]++;
+    close(fd);
+    return NULL;
+}
+
 int callback(const char *fpath, const struct stat *sb,
     int typeflag __attribute__((unused)),
     struct FTW *ftwbuf __attribute__((unused)))
 {
+    stats.visited++;
+    progress();
+
     // Ignore anything but regular files with content
     if (!S_ISREG(sb->st_mode) || sb->st_size == 0)
         return 0;
@@ -328,12 +833,23 @@ int callback(const char *fpath, const struct stat *sb,
     if (in_ignores(fpath))
         return 0;
 
+    // Shared files are hashed later, and only if they don't share
+    // their extents with some other file we found.
+    if (reflinks) {
+        char *key = extent_key(fpath, sb->st_size);
+        if (key != NULL) {
+            add_entry(fpath, sb->st_size, NULL);
+            entries[nentries_used - 1].extents = key;
+            return 0;
+        }
+    }
+
     char *string = hashfile(fpath, false);
     if (string == NULL)
         goto err;
 
     // So far so good. Store path and hash somewhere suitable for qsort().
-    add_entry(fpath, string);
+    add_entry(fpath, sb->st_size, string);
     return 0;
 
 err:
@@ -359,6 +875,63 @@ static void traverse_directories(void)
     }
 }
 
+static int cmp_extents(const void *v1, const void *v2)
+{
+    const struct entry *p1 = v1, *p2 = v2;
+
+    // Entries without extent maps go last.
+    if (p1->extents == NULL || p2->extents == NULL)
+        return (p1->extents == NULL) - (p2->extents == NULL);
+
+    return strcmp(p1->extents, p2->extents);
+}
+
+// Files with identical extent maps are reported as already deduplicated.
+// We keep the first file of each group, and hash it like any other file
+// so that we still find copies which aren't reflinked.
+static void resolve_reflinks(void)
+{
+    size_t i, first, n;
+
+    if (!reflinks)
+        return;
+
+    qsort(entries, nentries_used, sizeof *entries, cmp_extents);
+
+    for (first = 0; first < nentries_used && entries[first].extents != NULL; first = i) {
+        for (i = first + 1; i < nentries_used && entries[i].extents != NULL; i++) {
+            if (strcmp(entries[first].extents, entries[i].extents) != 0)
+                break;
+
+            printf("# shared '%s'\t'%s'\n", entries[first].fpath, entries[i].fpath);
+            stats.shared++;
+            free(entries[i].extents);
+            free(entries[i].fpath);
+            entries[i].extents = entries[i].fpath = NULL;
+        }
+    }
+
+    // Remove the reflinked entries and hash the remaining ones.
+    for (i = n = 0; i < nentries_used; i++) {
+        if (entries[i].fpath == NULL)
+            continue;
+
+        if (entries[i].hash4k == NULL) {
+            progress();
+            entries[i].hash4k = hashfile(entries[i].fpath, false);
+            if (entries[i].hash4k == NULL) {
+                free(entries[i].extents);
+                free(entries[i].fpath);
+                continue;
+            }
+        }
+
+        entries[n++] = entries[i];
+    }
+
+    nentries_used = n;
+}
+
 static int cmp_4k(const void *v1, const void *v2)
 {
     const struct entry *p1 = v1, *p2 = v2;
@@ -368,7 +941,7 @@ static int cmp_4k(const void *v1, const void *v2)
 static int cmp_full(const void *v1, const void *v2)
 {
     const struct entry *p1 = v1, *p2 = v2;
-    return strcmp(p1->hash4k, p2->hash4k);
+    return strcmp(p1->fullhash, p2->fullhash);
 }
 
 static void sort_results_4k(void)
@@ -381,24 +954,64 @@ static void sort_results_full(void)
     qsort(entries, nentries_used, sizeof *entries, cmp_full);
 }
 
-// If 4k hashes are equal, compute full hash.
-// If hashes differ, move 4k hash to full hash for uniform sorting later on.
+// If 4k hashes are equal, compute full hash. Files of 4K or less were
+// hashed in full already, so they keep their 4k hash as full hash.
+// If a 4k hash is unique, move it to full hash for uniform sorting later on.
 static void resolve_4k_dups(void)
 {
-    for (size_t i = 1; i < nentries_used; i++) {
-        if (strcmp(entries[i - 1].hash4k, entries[i].hash4k) != 0) {
-            entries[i - 1].fullhash = entries[i - 1].hash4k;
-            entries[i].fullhash = entries[i].hash4k;
+    size_t i, first, n;
+
+    for (first = 0; first < nentries_used; first = i) {
+        for (i = first + 1; i < nentries_used; i++) {
+            if (strcmp(entries[first].hash4k, entries[i].hash4k) != 0)
+                break;
+        }
+
+        if (i - first == 1) {
+            entries[first].fullhash = entries[first].hash4k;
+            stats.eliminated[TIER_4K]++;
+            continue;
+        }
+
+        for (n = first; n < i; n++) {
+            if (entries[n].size <= 4096)
+                entries[n].fullhash = entries[n].hash4k;
+            else {
+                progress();
+                entries[n].fullhash = hashfile(entries[n].fpath, true);
+            }
         }
     }
 
-    // Now re-hash all files with a NULL fullhash.
-    for (size_t i = 0; i < nentries_used; i++) {
+    // Forget files which disappeared while this program ran.
+    for (i = n = 0; i < nentries_used; i++) {
         if (entries[i].fullhash == NULL) {
-            entries[i].fullhash = hashfile(entries[i].fpath, true);
-            if (entries[i].fullhash == NULL) {
-                // File disappeared while this program ran?
-            }
+            free(entries[i].hash4k);
+            free(entries[i].extents);
+            free(entries[i].fpath);
+            continue;
+        }
+
+        entries[n++] = entries[i];
+    }
+
+    nentries_used = n;
+}
+
+// Count files which were hashed in full, but turned out to be unique.
+static void count_full_eliminations(void)
+{
+    size_t i, first, n;
+
+    for (first = 0; first < nentries_used; first = i) {
+        for (i = first + 1; i < nentries_used; i++) {
+            if (strcmp(entries[first].fullhash, entries[i].fullhash) != 0)
+                break;
+        }
+
+        for (n = first; i - first == 1 && n < i; n++) {
+            if (entries[n].fullhash != entries[n].hash4k)
+                stats.eliminated[TIER_FULL]++;
         }
     }
 }
@@ -408,16 +1021,37 @@ int main(int argc, char *argv[])
     size_t i;
 
     parse_command_line(argc, argv);
+
+    begin_phase(PH_TRAVERSE);
     traverse_directories();
+    end_phase(PH_TRAVERSE);
+
+    begin_phase(PH_REFLINKS);
+    resolve_reflinks();
+    end_phase(PH_REFLINKS);
+
+    begin_phase(PH_SORT_4K);
     sort_results_4k();
+    end_phase(PH_SORT_4K);
+
+    begin_phase(PH_HASH_FULL);
     resolve_4k_dups();
+    end_phase(PH_HASH_FULL);
+
+    begin_phase(PH_SORT_FULL);
     sort_results_full();
+    if (stats_format != NULL)
+        count_full_eliminations();
+    end_phase(PH_SORT_FULL);
+
+    begin_phase(PH_OUTPUT);
 
     // Assuming that we got this far, now what?
     // entries is now sorted by hash, so we can traverse it
     // to locate duplicates.
     for (i = 1; i < nentries_used; i++) {
         if (strcmp(entries[i - 1].fullhash, entries[i].fullhash) == 0) {
+            stats.duplicates++;
             if (master != NULL) {
                 if (strstr(entries[i - 1].fpath, master)) {
                     if (strstr(entries[i].fpath, master)) {
@@ -457,6 +1091,11 @@ int main(int argc, char *argv[])
     // mix masterdir with copydir.
 
     free_allocated_mem();
+    end_phase(PH_OUTPUT);
+
+    print_stats();
+    if (progress_file != NULL && progress_file != stderr)
+        fclose(progress_file);
 
     return 0;
 }
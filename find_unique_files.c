@@ -12,8 +12,13 @@
 // Eval-dir can be a subdirectory of master-dir. If so, duplicates will
 // be handled.
 //
-// This program doesn't care about differences in file contents. It only
-// looks for files in one tree which aren't in another tree. It could
+// Usage: find_unique_files -n dir1 dir2 ... dirN
+// We compare N trees with each other in one go, and print which trees
+// have each file.
+//
+// This program doesn't care about differences in file contents, unless
+// -c is given. It only looks for files in one tree which aren't in
+// another tree. It could
 // probably be written as a very short script, but wth, we like coding :)
 // BTW, what would a script look like?
 // find master-dir -type f > somefile
@@ -46,86 +51,1167 @@
 //
 
 
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ftw.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gcrypt.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ftw.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+int ftw_flags = FTW_ACTIONRETVAL | FTW_STOP | FTW_PHYS;
+int verbose = 0;
+int debug = 0;
+int silent = 0; // print error messages? (Some will always be printed)
+int content = 0; // Compare contents instead of names?
+const char *save_master = NULL; // Save master's tables to this file
+const char *master_index = NULL; // Load master's tables from this file
+int nway = 0; // Compare N trees with each other?
+int relative = 0; // Compare paths relative to the roots instead of names?
+int quick = 0; // Report missing, same and changed files?
+double bloom_rate = 0; // False positive rate of the Bloom filter, or 0 for none
+unsigned long long bloom_count = 0; // Expected number of master files, or 0
+
+// We store the directories to traverse in an array.
+static char masterdir[10240];
+static char evaldir[10240];
+static struct stat evalstat;
+
+// We store the basenames of master's files in an open addressing hash
+// table with linear probing. Each slot has the name's hash and its offset
+// in an arena holding the names, so a slot is 8 bytes and names are
+// stored once, no matter how many files share them. Offset 0 means the
+// slot is empty, so the arena starts with a dummy byte.
+struct slot {
+    uint32_t hash;
+    uint32_t offset;
+};
+
+static struct slot *slots;
+static size_t nslots; // Always a power of two
+static size_t nnames;
+
+static char *arena;
+static size_t arena_used, arena_size;
+
+// FNV-1a. Names are short, so it's fast enough.
+static uint32_t hash_name(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h ^ (h >> 32);
+}
+
+static uint32_t arena_add(const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *tmp;
+
+    if (arena_used + n > UINT32_MAX) {
+        fprintf(stderr, "error: Too many file names in master-dir\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (arena_used + n > arena_size) {
+        size_t newsize = arena_size == 0 ? 1024 * 1024 : arena_size * 2;
+
+        while (newsize < arena_used + n)
+            newsize *= 2;
+
+        if ((tmp = realloc(arena, newsize)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        arena = tmp;
+        arena_size = newsize;
+        if (arena_used == 0)
+            arena[arena_used++] = '\0';
+    }
+
+    memcpy(&arena[arena_used], s, n);
+    arena_used += n;
+    return arena_used - n;
+}
+
+// Returns the slot where name is, or where it should go.
+static struct slot *find_slot(const char *name, uint32_t hash)
+{
+    size_t i = hash & (nslots - 1);
+
+    while (slots[i].offset != 0) {
+        if (slots[i].hash == hash && strcmp(&arena[slots[i].offset], name) == 0)
+            break;
+
+        i = (i + 1) & (nslots - 1);
+    }
+
+    return &slots[i];
+}
+
+// Double the table. The hashes are stored, so we don't look at the names.
+static void grow_table(void)
+{
+    struct slot *old = slots;
+    size_t i, j, nold = nslots;
+
+    nslots = nslots == 0 ? 1024 * 1024 : nslots * 2;
+    if ((slots = calloc(nslots, sizeof *slots)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nold; i++) {
+        if (old[i].offset == 0)
+            continue;
+
+        for (j = old[i].hash & (nslots - 1); slots[j].offset != 0; j = (j + 1) & (nslots - 1))
+            ;
+
+        slots[j] = old[i];
+    }
+
+    free(old);
+}
+
+static uint32_t add_name(const char *name)
+{
+    uint32_t hash = hash_name(name);
+    struct slot *slot;
+
+    // Keep the load factor below 3/4
+    if ((nnames + 1) * 4 > nslots * 3)
+        grow_table();
+
+    slot = find_slot(name, hash);
+    if (slot->offset == 0) {
+        slot->offset = arena_add(name);
+        slot->hash = hash;
+        nnames++;
+    }
+
+    return slot->offset;
+}
+
+// With -r, we compare paths relative to master-dir and eval-dir, so
+// a/README only matches b/README, not b/doc/README. The paths are kept
+// in a trie of path components. The components are interned in the
+// name table above, so a node is its parent, the offset of its name,
+// and whether master has a file there. Children are found through a
+// hash table keyed by parent and name. nftw() reports directories
+// before their contents, so we keep the node of each directory level,
+// and do one lookup per file or directory.
+#define NO_NODE UINT32_MAX // Not in master's trie
+
+struct node {
+    uint32_t parent;
+    uint32_t name;
+    bool file;
+    uint32_t mtime_nsec; // Size and mtime of master's file, for -q
+    int64_t mtime;
+    uint64_t size;
+};
+
+struct edge {
+    uint32_t parent;
+    uint32_t name;
+    uint32_t node; // 0 means empty. 0 is the root, which is no one's child.
+};
+
+static struct node *nodes;
+static size_t nnodes, nodes_max;
+
+static struct edge *edges;
+static size_t nedges; // Always a power of two
+
+static uint32_t *levels; // Node of the directory at each level
+static size_t nlevels;
+
+static inline size_t hash_edge(uint32_t parent, uint32_t name)
+{
+    uint64_t h = ((uint64_t)parent << 32 | name) * 0x9e3779b97f4a7c15ULL;
+
+    return h ^ (h >> 32);
+}
+
+static struct edge *find_edge(uint32_t parent, uint32_t name)
+{
+    size_t i = hash_edge(parent, name) & (nedges - 1);
+
+    while (edges[i].node != 0 && (edges[i].parent != parent || edges[i].name != name))
+        i = (i + 1) & (nedges - 1);
+
+    return &edges[i];
+}
+
+static void grow_edges(void)
+{
+    struct edge *old = edges;
+    size_t i, nold = nedges;
+
+    nedges = nedges == 0 ? 1024 * 1024 : nedges * 2;
+    if ((edges = calloc(nedges, sizeof *edges)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nold; i++) {
+        if (old[i].node != 0)
+            *find_edge(old[i].parent, old[i].name) = old[i];
+    }
+
+    free(old);
+}
+
+static uint32_t add_node(uint32_t parent, uint32_t name)
+{
+    struct node *tmp;
+
+    if (nnodes == nodes_max) {
+        nodes_max = nodes_max == 0 ? 1024 * 1024 : nodes_max * 2;
+        if (nodes_max > NO_NODE || (tmp = realloc(nodes, nodes_max * sizeof *nodes)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        nodes = tmp;
+    }
+
+    memset(&nodes[nnodes], 0, sizeof *nodes);
+    nodes[nnodes].parent = parent;
+    nodes[nnodes].name = name;
+    return nnodes++;
+}
+
+// Returns the child of parent called name, adding it if needed.
+static uint32_t add_child(uint32_t parent, const char *name)
+{
+    uint32_t offset = add_name(name);
+    struct edge *e;
+
+    // Keep the load factor below 3/4. nnodes - 1 edges are in use.
+    if (nnodes * 4 > nedges * 3)
+        grow_edges();
+
+    e = find_edge(parent, offset);
+    if (e->node == 0) {
+        e->parent = parent;
+        e->name = offset;
+        e->node = add_node(parent, offset);
+    }
+
+    return e->node;
+}
+
+// Returns the child of parent called name, or NO_NODE.
+static uint32_t find_child(uint32_t parent, const char *name)
+{
+    struct slot *slot;
+    struct edge *e;
+
+    if (parent == NO_NODE || nslots == 0 || nedges == 0)
+        return NO_NODE;
+
+    if ((slot = find_slot(name, hash_name(name)))->offset == 0)
+        return NO_NODE;
+
+    e = find_edge(parent, slot->offset);
+    return e->node == 0 ? NO_NODE : e->node;
+}
+
+static void set_level(int level, uint32_t node)
+{
+    uint32_t *tmp;
+
+    if ((size_t)level >= nlevels) {
+        nlevels = nlevels == 0 ? 64 : nlevels * 2;
+        if ((tmp = realloc(levels, nlevels * sizeof *levels)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        levels = tmp;
+    }
+
+    levels[level] = node;
+}
+
+static void add_master_path(const char *name, const struct stat *sb, int typeflag, int level)
+{
+    uint32_t node;
+
+    if (level == 0) {
+        if (nnodes == 0)
+            add_node(0, 0);
+        set_level(0, 0);
+        return;
+    }
+
+    node = add_child(levels[level - 1], name);
+    if (typeflag == FTW_D)
+        set_level(level, node);
+    else {
+        nodes[node].file = true;
+        nodes[node].size = sb->st_size;
+        nodes[node].mtime = sb->st_mtim.tv_sec;
+        nodes[node].mtime_nsec = sb->st_mtim.tv_nsec;
+    }
+}
+
+// Returns the node of master's file with the same relative path, or
+// NO_NODE. For directories, it just keeps track of where we are.
+static uint32_t find_master_file(const char *name, int typeflag, int level)
+{
+    uint32_t node;
+
+    if (level == 0) {
+        set_level(0, nnodes == 0 ? NO_NODE : 0);
+        return NO_NODE;
+    }
+
+    node = find_child(levels[level - 1], name);
+    if (typeflag == FTW_D)
+        set_level(level, node);
+
+    return node != NO_NODE && nodes[node].file ? node : NO_NODE;
+}
+
+// master-dir's path of a node. We don't store paths, but the trie has
+// every component.
+static int node_path(uint32_t node, char *buf, size_t size)
+{
+    size_t len;
+
+    if (node == 0)
+        return (size_t)snprintf(buf, size, "%s", masterdir) < size ? 0 : -1;
+
+    if (node_path(nodes[node].parent, buf, size) == -1)
+        return -1;
+
+    len = strlen(buf);
+    return (size_t)snprintf(buf + len, size - len, "/%s", &arena[nodes[node].name]) < size - len ? 0 : -1;
+}
+
+// With -q, we compare eval's files with master's files of the same
+// relative path, like rsync does. Files with different sizes have
+// changed, and files with the same size and mtime are the same, so we
+// read no data for them. Otherwise we compare the files, cheap tiers
+// first: the first and last blocks, which is where most changes show
+// up, and then the rest, stopping at the first difference. Two local
+// files are compared directly, since hashing would read both in full.
+#define QUICK_BLOCK (64 * 1024)
+
+enum quick_result { QUICK_SAME, QUICK_CHANGED, QUICK_FAILED };
+
+static struct {
+    unsigned long long missing, same, changed, compared, bytes_read;
+} quickcounts;
+
+// Compare len bytes from offset. Returns 0 if equal, 1 if not, -1 on errors.
+static int compare_range(int fd1, int fd2, off_t offset, off_t len)
+{
+    static char buf1[QUICK_BLOCK * 16], buf2[QUICK_BLOCK * 16];
+    ssize_t n1, n2;
+    size_t n;
+
+    while (len > 0) {
+        n = len < (off_t)sizeof buf1 ? (size_t)len : sizeof buf1;
+        if ((n1 = pread(fd1, buf1, n, offset)) == -1 || (n2 = pread(fd2, buf2, n, offset)) == -1)
+            return -1;
+
+        quickcounts.bytes_read += n1 + n2;
+
+        // A short read means the file changed under us. Not the same.
+        if (n1 != n2 || memcmp(buf1, buf2, n1) != 0 || n1 == 0)
+            return 1;
+
+        offset += n1;
+        len -= n1;
+    }
+
+    return 0;
+}
+
+static enum quick_result compare_files(const char *path1, const char *path2, off_t size)
+{
+    int fd1, fd2, rc;
+
+    if ((fd1 = open(path1, O_RDONLY)) == -1) {
+        if (!silent)
+            perror(path1);
+        return QUICK_FAILED;
+    }
+
+    if ((fd2 = open(path2, O_RDONLY)) == -1) {
+        if (!silent)
+            perror(path2);
+        close(fd1);
+        return QUICK_FAILED;
+    }
+
+    quickcounts.compared++;
+    if (size <= 2 * QUICK_BLOCK)
+        rc = compare_range(fd1, fd2, 0, size);
+    else if ((rc = compare_range(fd1, fd2, 0, QUICK_BLOCK)) == 0
+    && (rc = compare_range(fd1, fd2, size - QUICK_BLOCK, QUICK_BLOCK)) == 0)
+        rc = compare_range(fd1, fd2, QUICK_BLOCK, size - 2 * QUICK_BLOCK);
+
+    if (rc == -1 && !silent)
+        fprintf(stderr, "%s, %s: %s\n", path1, path2, strerror(errno));
+
+    close(fd1);
+    close(fd2);
+    return rc == 0 ? QUICK_SAME : rc == 1 ? QUICK_CHANGED : QUICK_FAILED;
+}
+
+static void quick_check(const char *fpath, const struct stat *sb, uint32_t node)
+{
+    char mpath[PATH_MAX];
+    const struct node *n;
+
+    if (node == NO_NODE) {
+        quickcounts.missing++;
+        printf("missing %s\n", fpath);
+        return;
+    }
+
+    n = &nodes[node];
+    if (n->size == (uint64_t)sb->st_size && n->mtime == sb->st_mtim.tv_sec
+    && n->mtime_nsec == (uint32_t)sb->st_mtim.tv_nsec) {
+        quickcounts.same++;
+        printf("same %s\n", fpath);
+        return;
+    }
+
+    if (n->size != (uint64_t)sb->st_size) {
+        quickcounts.changed++;
+        printf("changed %s\n", fpath);
+        return;
+    }
+
+    if (node_path(node, mpath, sizeof mpath) == -1) {
+        fprintf(stderr, "%s: Path too long\n", fpath);
+        return;
+    }
+
+    switch (compare_files(mpath, fpath, sb->st_size)) {
+        case QUICK_SAME:
+            quickcounts.same++;
+            printf("same %s\n", fpath);
+            break;
+
+        case QUICK_CHANGED:
+            quickcounts.changed++;
+            printf("changed %s\n", fpath);
+            break;
+
+        case QUICK_FAILED:
+            break;
+    }
+}
+
+// With -c, a file is in master if master has a file with the same size
+// and contents, whatever its name. We keep the size and path of every
+// master file, chained per size in a hash table keyed by size. Files are
+// hashed lazily: eval files only if master has files of the same size,
+// and master files only when an eval file of the same size shows up.
+// Most files have a size of their own, so we read few files.
+#define DIGEST_SIZE 20 // SHA1
+
+struct mfile {
+    uint64_t size;
+    size_t path;   // Offset in paths
+    size_t next;   // Next file with the same size, plus one. 0 ends the chain.
+    bool hashed;   // Do we have the digest?
+    bool failed;   // Couldn't read the file
+    unsigned char digest[DIGEST_SIZE];
+};
+
+static struct mfile *mfiles;
+static size_t nmfiles, mfiles_max;
+
+static char *paths;
+static size_t paths_used, paths_size;
+
+struct sizeslot {
+    uint64_t size;
+    size_t head; // First file with this size, plus one. 0 means empty.
+};
+
+static struct sizeslot *sizeslots;
+static size_t nsizeslots, nsizes; // nsizeslots is a power of two
+
+static struct {
+    unsigned long master_hashed, eval_hashed;
+    unsigned long long bytes_hashed;
+} counts;
+
+static inline size_t hash_size(uint64_t size)
+{
+    size *= 0x9e3779b97f4a7c15ULL;
+    return size ^ (size >> 32);
+}
+
+static struct sizeslot *find_size(uint64_t size)
+{
+    size_t i = hash_size(size) & (nsizeslots - 1);
+
+    while (sizeslots[i].head != 0 && sizeslots[i].size != size)
+        i = (i + 1) & (nsizeslots - 1);
+
+    return &sizeslots[i];
+}
+
+static void grow_sizes(void)
+{
+    struct sizeslot *old = sizeslots;
+    size_t i, nold = nsizeslots;
+
+    nsizeslots = nsizeslots == 0 ? 64 * 1024 : nsizeslots * 2;
+    if ((sizeslots = calloc(nsizeslots, sizeof *sizeslots)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nold; i++) {
+        if (old[i].head != 0)
+            *find_size(old[i].size) = old[i];
+    }
+
+    free(old);
+}
+
+static size_t add_path(const char *s)
+{
+    size_t n = strlen(s) + 1;
+    char *tmp;
+
+    if (paths_used + n > paths_size) {
+        size_t newsize = paths_size == 0 ? 1024 * 1024 : paths_size * 2;
+
+        while (newsize < paths_used + n)
+            newsize *= 2;
+
+        if ((tmp = realloc(paths, newsize)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        paths = tmp;
+        paths_size = newsize;
+    }
+
+    memcpy(&paths[paths_used], s, n);
+    paths_used += n;
+    return paths_used - n;
+}
+
+static void add_master_file(const char *fpath, uint64_t size)
+{
+    struct sizeslot *slot;
+    struct mfile *tmp, *f;
+
+    if (nmfiles == mfiles_max) {
+        mfiles_max = mfiles_max == 0 ? 300000 : mfiles_max * 2;
+        if ((tmp = realloc(mfiles, mfiles_max * sizeof *mfiles)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        mfiles = tmp;
+    }
+
+    if ((nsizes + 1) * 4 > nsizeslots * 3)
+        grow_sizes();
+
+    f = &mfiles[nmfiles++];
+    f->size = size;
+    f->path = add_path(fpath);
+    f->hashed = f->failed = false;
+
+    slot = find_size(size);
+    if (slot->head == 0) {
+        slot->size = size;
+        nsizes++;
+    }
+
+    f->next = slot->head;
+    slot->head = nmfiles;
+}
+
+// Read the file in chunks and hash it.
+static int hash_file(const char *fpath, unsigned char *digest)
+{
+    static char buf[1024 * 1024];
+    gcry_md_hd_t hd;
+    ssize_t nread;
+    int fd, err = 0;
+
+    if ((fd = open(fpath, O_RDONLY)) == -1) {
+        if (!silent)
+            perror(fpath);
+        return -1;
+    }
+
+    if (gcry_md_open(&hd, GCRY_MD_SHA1, 0) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((nread = read(fd, buf, sizeof buf)) != 0) {
+        if (nread == -1) {
+            if (errno == EINTR)
+                continue;
+
+            err = errno;
+            break;
+        }
+
+        gcry_md_write(hd, buf, nread);
+        counts.bytes_hashed += nread;
+    }
+
+    if (err == 0)
+        memcpy(digest, gcry_md_read(hd, GCRY_MD_SHA1), DIGEST_SIZE);
+    else if (!silent)
+        fprintf(stderr, "%s: %s\n", fpath, strerror(err));
+
+    gcry_md_close(hd);
+    close(fd);
+    return err == 0 ? 0 : -1;
+}
+
+static int content_in_master(const char *fpath, uint64_t size)
+{
+    unsigned char digest[DIGEST_SIZE];
+    struct mfile *f;
+    size_t i;
+
+    if (nsizeslots == 0 || (i = find_size(size)->head) == 0)
+        return 0;
+
+    // Unreadable files aren't in master, as far as we can tell.
+    if (hash_file(fpath, digest) == -1)
+        return 0;
+
+    counts.eval_hashed++;
+    for (; i != 0; i = f->next) {
+        f = &mfiles[i - 1];
+        if (!f->hashed && !f->failed) {
+            if (hash_file(&paths[f->path], f->digest) == 0) {
+                f->hashed = true;
+                counts.master_hashed++;
+            }
+            else
+                f->failed = true;
+        }
+
+        if (f->hashed && memcmp(f->digest, digest, DIGEST_SIZE) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+// A master index is a snapshot of the tables above, so we can check
+// several eval trees without walking master each time. The tables are
+// written as is, and mapped back in. The mapping is private and
+// writable, so digests computed while we run go to our own pages. A
+// snapshot always has both the name table and the content tables.
+#define INDEX_MAGIC "FUFIDX\0\0"
+#define INDEX_VERSION 1
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t mfile_size; // sizeof(struct mfile). Differs between ABIs.
+    uint64_t nnames, nslots, arena_size;
+    uint64_t nmfiles, nsizes, nsizeslots, paths_size;
+    uint64_t slots_offset, arena_offset, mfiles_offset, sizeslots_offset, paths_offset;
+};
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static int write_section(FILE *f, const void *p, size_t size)
+{
+    static const char zeros[8];
+
+    if (size > 0 && fwrite(p, size, 1, f) != 1)
+        return -1;
+
+    return fwrite(zeros, align8(size) - size, 1, f) == 1 || align8(size) == size ? 0 : -1;
+}
+
+static void write_master_index(const char *filename)
+{
+    char tmpname[PATH_MAX];
+    struct index_header h;
+    FILE *f;
+    int fd;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, INDEX_MAGIC, sizeof h.magic);
+    h.version = INDEX_VERSION;
+    h.mfile_size = sizeof *mfiles;
+    h.nnames = nnames;
+    h.nslots = nslots;
+    h.arena_size = arena_used;
+    h.nmfiles = nmfiles;
+    h.nsizes = nsizes;
+    h.nsizeslots = nsizeslots;
+    h.paths_size = paths_used;
+
+    h.slots_offset = sizeof h;
+    h.arena_offset = h.slots_offset + align8(nslots * sizeof *slots);
+    h.mfiles_offset = h.arena_offset + align8(arena_used);
+    h.sizeslots_offset = h.mfiles_offset + align8(nmfiles * sizeof *mfiles);
+    h.paths_offset = h.sizeslots_offset + align8(nsizeslots * sizeof *sizeslots);
+
+    if ((size_t)snprintf(tmpname, sizeof tmpname, "%s.XXXXXX", filename) >= sizeof tmpname) {
+        fprintf(stderr, "%s: File name too long\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fd = mkstemp(tmpname)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+        perror(tmpname);
+        exit(EXIT_FAILURE);
+    }
+
+    if (fwrite(&h, sizeof h, 1, f) != 1
+    || write_section(f, slots, nslots * sizeof *slots) == -1
+    || write_section(f, arena, arena_used) == -1
+    || write_section(f, mfiles, nmfiles * sizeof *mfiles) == -1
+    || write_section(f, sizeslots, nsizeslots * sizeof *sizeslots) == -1
+    || write_section(f, paths, paths_used) == -1
+    || fflush(f) == EOF || fsync(fileno(f)) == -1
+    || fchmod(fileno(f), 0644) == -1 || fclose(f) == EOF
+    || rename(tmpname, filename) == -1) {
+        perror(filename);
+        unlink(tmpname);
+        exit(EXIT_FAILURE);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Saved %zu names and %zu files to %s\n", nnames, nmfiles, filename);
+}
+
+static int section_ok(uint64_t offset, uint64_t size, size_t mapsize)
+{
+    return offset <= mapsize && size <= mapsize - offset;
+}
+
+static void load_master_index(const char *filename)
+{
+    const struct index_header *h;
+    struct stat st;
+    char *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    if ((size_t)st.st_size < sizeof *h)
+        goto bad;
+
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+
+    h = (const void *)map;
+    if (memcmp(h->magic, INDEX_MAGIC, sizeof h->magic) != 0
+    || h->version != INDEX_VERSION
+    || h->mfile_size != sizeof *mfiles
+    || (h->nslots & (h->nslots - 1)) != 0
+    || (h->nsizeslots & (h->nsizeslots - 1)) != 0
+    || h->nslots > SIZE_MAX / sizeof *slots
+    || h->nmfiles > SIZE_MAX / sizeof *mfiles
+    || h->nsizeslots > SIZE_MAX / sizeof *sizeslots
+    || !section_ok(h->slots_offset, h->nslots * sizeof *slots, st.st_size)
+    || !section_ok(h->arena_offset, h->arena_size, st.st_size)
+    || !section_ok(h->mfiles_offset, h->nmfiles * sizeof *mfiles, st.st_size)
+    || !section_ok(h->sizeslots_offset, h->nsizeslots * sizeof *sizeslots, st.st_size)
+    || !section_ok(h->paths_offset, h->paths_size, st.st_size)
+    || (h->arena_size > 0 && map[h->arena_offset + h->arena_size - 1] != '\0')
+    || (h->paths_size > 0 && map[h->paths_offset + h->paths_size - 1] != '\0'))
+        goto bad;
+
+    // The tables are ours now. We never add to them, so they're never
+    // reallocated.
+    slots = (void *)(map + h->slots_offset);
+    nslots = h->nslots;
+    nnames = h->nnames;
+    arena = map + h->arena_offset;
+    arena_used = arena_size = h->arena_size;
+    mfiles = (void *)(map + h->mfiles_offset);
+    nmfiles = mfiles_max = h->nmfiles;
+    sizeslots = (void *)(map + h->sizeslots_offset);
+    nsizeslots = h->nsizeslots;
+    nsizes = h->nsizes;
+    paths = map + h->paths_offset;
+    paths_used = paths_size = h->paths_size;
+
+    if (verbose)
+        fprintf(stderr, "Loaded %zu names and %zu files from %s\n", nnames, nmfiles, filename);
+    return;
+
+bad:
+    fprintf(stderr, "%s: Not a master index, or wrong version. Save it again.\n", filename);
+    exit(EXIT_FAILURE);
+}
+
+// With -n, we compare N trees with each other, instead of one tree with
+// another. Each tree is walked by a thread of its own, into a list of
+// its own. Then we merge the lists into one table of keys, names or
+// sizes and digests, each with a bitmap of the trees it's in, and print
+// every file with the bitmap of its key. That's linear in the number of
+// files, however many trees we have.
+//
+// With -c, we first merge by size. Files with a size found in one tree
+// only are unique, and only the others need to be hashed. Then we merge
+// the hashed files again, by size and digest.
+#define MAX_TREES 64
+
+struct tfile {
+    uint64_t size;
+    uint64_t in;   // Bitmap of trees with the same key
+    size_t path;   // Offset in the tree's paths
+    size_t key;    // Slot of the file's key while merging
+    uint32_t base; // Offset of the basename in the path
+    bool hashed;
+    unsigned char digest[DIGEST_SIZE];
+};
+
+struct tree {
+    const char *dir;
+    struct tfile *files;
+    size_t nfiles, files_max;
+    char *paths;
+    size_t paths_used, paths_size;
+    pthread_t tid;
+    int err;
+};
+
+static struct tree trees[MAX_TREES];
+static int ntrees;
+
+// nftw() passes no argument to the callback, so each walker finds its
+// tree here.
+static __thread struct tree *current_tree;
+
+enum keytype { KEY_NAME, KEY_SIZE, KEY_CONTENT };
+
+struct key {
+    uint64_t in;   // Bitmap of trees. 0 means the slot is empty.
+    size_t file;   // A file with this key, for comparisons
+    uint32_t hash;
+    uint32_t tree;
+};
+
+static struct key *keys;
+static size_t nkeys, nkeyslots; // nkeyslots is a power of two
+
+static int tree_callback(const char *fpath, const struct stat *sb, int typeflag __attribute__((unused)), struct FTW *ftwbuf)
+{
+    struct tree *t = current_tree;
+    size_t n = strlen(fpath) + 1;
+    struct tfile *f;
+    void *tmp;
+
+    // Ignore anything but regular files, and empty ones too.
+    if (!S_ISREG(sb->st_mode) || sb->st_size == 0) {
+        if (debug)
+            fprintf(stderr, "Skipping %s. Not a regular file, or empty.\n", fpath);
+        return 0;
+    }
+
+    if (t->nfiles == t->files_max) {
+        t->files_max = t->files_max == 0 ? 64 * 1024 : t->files_max * 2;
+        if ((tmp = realloc(t->files, t->files_max * sizeof *t->files)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        t->files = tmp;
+    }
+
+    if (t->paths_used + n > t->paths_size) {
+        size_t newsize = t->paths_size == 0 ? 1024 * 1024 : t->paths_size * 2;
+
+        while (newsize < t->paths_used + n)
+            newsize *= 2;
+
+        if ((tmp = realloc(t->paths, newsize)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        t->paths = tmp;
+        t->paths_size = newsize;
+    }
+
+    f = &t->files[t->nfiles++];
+    memset(f, 0, sizeof *f);
+    f->size = sb->st_size;
+    f->path = t->paths_used;
+    f->base = ftwbuf->base;
+    memcpy(&t->paths[t->paths_used], fpath, n);
+    t->paths_used += n;
+    return 0;
+}
 
-#include <unistd.h>
+static void *walk_tree(void *arg)
+{
+    int nopenfd = 12;
 
-int ftw_flags = FTW_ACTIONRETVAL | FTW_STOP | FTW_PHYS;
-int verbose = 0;
-int debug = 0;
-int silent = 0; // print error messages? (Some will always be printed)
+    current_tree = arg;
+    if (nftw(current_tree->dir, tree_callback, nopenfd, ftw_flags) == -1)
+        current_tree->err = errno;
 
-// We store the directories to traverse in an array.
-static char masterdir[10240];
-static char evaldir[10240];
+    return NULL;
+}
 
-// We store paths values in structs like this:
-struct entry {
-    char *fpath; // path to file in master-dir, incl name
-    char *fname; // basename of file, for faster lookup.
-};
+static uint32_t key_hash(enum keytype type, const struct tree *t, const struct tfile *f)
+{
+    uint32_t h;
 
-struct entry *entries = NULL;
-size_t nentries_max = 0; // How many have we allocated room for?
-size_t nentries_used = 0; // How many has been used?
+    switch (type) {
+        case KEY_NAME:
+            return hash_name(&t->paths[f->path + f->base]);
 
-size_t initial_nentries = 300000; // We start off supporting that many entries
+        case KEY_SIZE:
+            return hash_size(f->size);
+
+        case KEY_CONTENT:
+        default:
+            // The digest is as good a hash as any.
+            memcpy(&h, f->digest, sizeof h);
+            return h;
+    }
+}
 
-static void add_entry(const char *fpath)
+static int same_key(enum keytype type, const struct tree *ta, const struct tfile *a,
+    const struct tree *tb, const struct tfile *b)
 {
-    if (nentries_max == 0) {
-        // first entry.
-        if ((entries = malloc(sizeof *entries * initial_nentries)) == NULL) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
-        }
+    switch (type) {
+        case KEY_NAME:
+            return strcmp(&ta->paths[a->path + a->base], &tb->paths[b->path + b->base]) == 0;
 
-        nentries_max = initial_nentries;
+        case KEY_SIZE:
+            return a->size == b->size;
+
+        case KEY_CONTENT:
+        default:
+            return a->size == b->size && memcmp(a->digest, b->digest, DIGEST_SIZE) == 0;
     }
-    else if (nentries_used == nentries_max) {
-        // reallocate
-        struct entry *tmp;
-        size_t new_size = nentries_max * 2 * sizeof *entries;
+}
 
-        if ((tmp = realloc(entries, new_size)) == NULL) {
-            fprintf(stderr, "Out of memory\n");
-            exit(EXIT_FAILURE);
+static void add_key(enum keytype type, int t, size_t i)
+{
+    struct tfile *f = &trees[t].files[i];
+    uint32_t hash = key_hash(type, &trees[t], f);
+    struct key *k;
+    size_t j;
+
+    for (j = hash & (nkeyslots - 1);; j = (j + 1) & (nkeyslots - 1)) {
+        k = &keys[j];
+        if (k->in == 0) {
+            k->hash = hash;
+            k->tree = t;
+            k->file = i;
+            nkeys++;
+            break;
         }
-        entries = tmp;
-        nentries_max *= 2;
+
+        if (k->hash == hash && same_key(type, &trees[k->tree], &trees[k->tree].files[k->file], &trees[t], f))
+            break;
+    }
+
+    k->in |= UINT64_C(1) << t;
+    f->key = j;
+}
+
+// Merge the trees' files by key, and give each file the bitmap of its
+// key. We know how many files there are, so the table never grows. With
+// KEY_CONTENT, we merge the hashed files only.
+static void merge_trees(enum keytype type)
+{
+    size_t i, total = 0;
+    int t;
+
+    for (t = 0; t < ntrees; t++) {
+        for (i = 0; i < trees[t].nfiles; i++)
+            total += type != KEY_CONTENT || trees[t].files[i].hashed;
     }
 
-    if ((entries[nentries_used].fpath = strdup(fpath)) == NULL) {
+    free(keys);
+    nkeys = 0;
+    for (nkeyslots = 1024; nkeyslots < total * 2; nkeyslots *= 2)
+        ;
+
+    if ((keys = calloc(nkeyslots, sizeof *keys)) == NULL) {
         fprintf(stderr, "Out of memory\n");
         exit(EXIT_FAILURE);
     }
 
-    // Now get the basename of the file, including extension of course.
-    // I.e., anything to the right of the rightmost slash, if any.
-    entries[nentries_used].fname = strrchr(fpath, '/');
-    if (entries[nentries_used].fname == NULL) {
-        fprintf(stderr, "error: Expected a / somewhere in path: %s\n", fpath);
-        exit(EXIT_FAILURE);
+    for (t = 0; t < ntrees; t++) {
+        for (i = 0; i < trees[t].nfiles; i++) {
+            if (type != KEY_CONTENT || trees[t].files[i].hashed)
+                add_key(type, t, i);
+        }
+    }
+
+    for (t = 0; t < ntrees; t++) {
+        for (i = 0; i < trees[t].nfiles; i++) {
+            struct tfile *f = &trees[t].files[i];
+
+            if (type != KEY_CONTENT || f->hashed)
+                f->in = keys[f->key].in;
+        }
+    }
+}
+
+// Hash the files with a size found in more than one tree. Files we
+// can't read are only in their own tree, as far as we can tell.
+static void hash_shared_sizes(void)
+{
+    size_t i;
+    int t;
+
+    for (t = 0; t < ntrees; t++) {
+        for (i = 0; i < trees[t].nfiles; i++) {
+            struct tfile *f = &trees[t].files[i];
+
+            if ((f->in & (f->in - 1)) == 0)
+                continue;
+
+            if (hash_file(&trees[t].paths[f->path], f->digest) == 0) {
+                f->hashed = true;
+                counts.eval_hashed++;
+            }
+            else
+                f->in = UINT64_C(1) << t;
+        }
+    }
+}
+
+// Print each file with its trees, one character per tree, 1 if the
+// tree has it and 0 if not. Files unique to the second of three trees
+// are printed as 010.
+static void report_trees(void)
+{
+    char pattern[MAX_TREES + 1];
+    size_t i, unique;
+    int t, j;
+
+    pattern[ntrees] = '\0';
+    for (t = 0; t < ntrees; t++) {
+        unique = 0;
+        for (i = 0; i < trees[t].nfiles; i++) {
+            const struct tfile *f = &trees[t].files[i];
+
+            for (j = 0; j < ntrees; j++)
+                pattern[j] = f->in & (UINT64_C(1) << j) ? '1' : '0';
+
+            unique += f->in == UINT64_C(1) << t;
+            printf("%s %s\n", pattern, &trees[t].paths[f->path]);
+        }
+
+        if (verbose)
+            fprintf(stderr, "%s: %zu files, %zu unique\n", trees[t].dir, trees[t].nfiles, unique);
+    }
+}
+
+static void compare_trees(void)
+{
+    int t;
+
+    for (t = 0; t < ntrees; t++) {
+        if (verbose)
+            fprintf(stderr, "Checking directory:%s\n", trees[t].dir);
+
+        if (pthread_create(&trees[t].tid, NULL, walk_tree, &trees[t]) != 0) {
+            fprintf(stderr, "Could not start a thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (t = 0; t < ntrees; t++) {
+        pthread_join(trees[t].tid, NULL);
+        if (trees[t].err != 0 && !silent)
+            fprintf(stderr, "%s: %s\n", trees[t].dir, strerror(trees[t].err));
+    }
+
+    if (content) {
+        merge_trees(KEY_SIZE);
+        hash_shared_sizes();
+        merge_trees(KEY_CONTENT);
     }
+    else
+        merge_trees(KEY_NAME);
 
-    // Skip slash
-    entries[nentries_used].fname++;
+    if (verbose)
+        fprintf(stderr, "%zu distinct keys in %zu slots\n", nkeys, nkeyslots);
 
-    nentries_used++;
+    report_trees();
 }
 
 static void show_usage(void)
 {
     static const char *text[] = {
         "USAGE: find_unique_files [options] master-dir eval-dir",
+        "       find_unique_files [options] --save-master file master-dir [eval-dir]",
+        "       find_unique_files [options] --master-index file eval-dir",
+        "       find_unique_files [options] -n dir dir [dir...]",
         "",
         "The program will look for files from eval-dir which aren't present in master-dir",
         "",
         "options",
+        "-n Compare up to 64 trees with each other. Every file is printed with",
+        "   a pattern of the trees which have it, one character per tree, 1 if",
+        "   the tree has it and 0 if not. 0100 means unique to the second tree.",
+        "--save-master file Save what we know about master-dir to file, so later",
+        "   runs can use it instead of walking master-dir. Paths are saved as",
+        "   absolute paths. Digests computed with -c are saved too.",
+        "--master-index file Use a file saved by --save-master instead of",
+        "   master-dir. eval-dir should not be inside the saved master-dir,",
+        "   as its files are in the index.",
+        "-r Compare paths relative to master-dir and eval-dir, not just names.",
+        "   eval-dir/a/README is only in master-dir if master-dir/a/README is.",
+        "-q Quick check, like rsync. Implies -r. Every file in eval-dir is",
+        "   printed as missing, same or changed. Files with the same size and",
+        "   mtime are the same, and files with different sizes have changed.",
+        "   Other files are compared, and files we can't read are skipped.",
+        "-b rate Use a Bloom filter with this false positive rate, e.g. 0.001,",
+        "   for master-dir. It uses about 1.44 * log2(1/rate) bits per file,",
+        "   however long the names are. master-dir is walked twice, or three",
+        "   times without -N. Works with -r too.",
+        "-N count The number of files in master-dir, to size the filter. An",
+        "   estimate will do. Without it, we count them first.",
+        "-c Compare contents. A file is in master-dir if a file there has",
+        "   the same size and contents, whatever its name.",
         "-x Stay on file system. Dont' traverse into mounted filesystems.",
         "-v Verbose. Print info as we progress.",
         "-s silent. Don't print (most) error messages.",
@@ -159,14 +1245,20 @@ static void parse_command_line(int argc, char *argv[])
     extern char *optarg;
     extern int optind;
 
-    const char *options = "vhxds";
+    const char *options = "vhxdscnrqb:N:";
+    static const struct option longopts[] = {
+        { "save-master", required_argument, NULL, 'S' },
+        { "master-index", required_argument, NULL, 'M' },
+        { NULL, 0, NULL, 0 }
+    };
+    int ndirs;
 
     if (argc == 1) {
         show_usage();
         exit(EXIT_FAILURE);
     }
 
-    while ((c = getopt(argc, argv, options)) != -1) {
+    while ((c = getopt_long(argc, argv, options, longopts, NULL)) != -1) {
         switch (c) {
             case 'h':
                 show_usage();
@@ -176,6 +1268,42 @@ static void parse_command_line(int argc, char *argv[])
                 silent = 1;
                 break;
 
+            case 'c':
+                content = 1;
+                break;
+
+            case 'n':
+                nway = 1;
+                break;
+
+            case 'r':
+                relative = 1;
+                break;
+
+            case 'q':
+                quick = relative = 1;
+                break;
+
+            case 'b':
+                bloom_rate = strtod(optarg, NULL);
+                if (bloom_rate <= 0 || bloom_rate >= 1) {
+                    fprintf(stderr, "-b needs a rate between 0 and 1, e.g. 0.001\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'N':
+                bloom_count = strtoull(optarg, NULL, 0);
+                break;
+
+            case 'S':
+                save_master = optarg;
+                break;
+
+            case 'M':
+                master_index = optarg;
+                break;
+
             case 'd':
                 debug = 1;
                 break;
@@ -195,24 +1323,78 @@ static void parse_command_line(int argc, char *argv[])
         }
     }
 
-    /* Now store the directories. We need two, master and eval. */
-    if (argc - optind != 2) {
-        show_usage();
+    if (quick && bloom_rate > 0) {
+        fprintf(stderr, "-q can't be combined with -b\n");
         exit(EXIT_FAILURE);
     }
 
-    /* Path too long? */
-    size_t n = strlen(argv[optind]);
-    if (n >= sizeof masterdir) {
-        fprintf(stderr, "error: path too long\n");
+    if (bloom_rate > 0 && (content || nway || save_master != NULL || master_index != NULL)) {
+        fprintf(stderr, "-b can't be combined with -c, -n, --save-master or --master-index\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The trie isn't saved, and the other modes don't look at paths.
+    if (relative && bloom_rate == 0 && (content || nway || save_master != NULL || master_index != NULL)) {
+        fprintf(stderr, "-r can't be combined with -c, -n, --save-master or --master-index\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (nway) {
+        ntrees = argc - optind;
+        if (ntrees < 2 || ntrees > MAX_TREES || save_master != NULL || master_index != NULL) {
+            show_usage();
+            exit(EXIT_FAILURE);
+        }
+
+        for (c = 0; c < ntrees; c++) {
+            trees[c].dir = argv[optind + c];
+            if (!isdirectory(trees[c].dir)) {
+                show_usage();
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        return;
+    }
+
+    /* Now store the directories. We need two, master and eval, unless
+     * master comes from an index. eval is optional when saving master. */
+    ndirs = argc - optind;
+    if ((master_index != NULL && ndirs != 1)
+    || (master_index == NULL && save_master == NULL && ndirs != 2)
+    || (master_index == NULL && save_master != NULL && ndirs != 1 && ndirs != 2)) {
+        show_usage();
         exit(EXIT_FAILURE);
     }
 
-    memcpy(masterdir, argv[optind], n);
+    if (master_index == NULL) {
+        /* Path too long? */
+        size_t n = strlen(argv[optind]);
+        if (n >= sizeof masterdir) {
+            fprintf(stderr, "error: path too long\n");
+            exit(EXIT_FAILURE);
+        }
+
+        memcpy(masterdir, argv[optind], n);
+        optind++;
+
+        if (!isdirectory(masterdir)) {
+            show_usage();
+            exit(EXIT_FAILURE);
+        }
+
+        // Saved paths must work from anywhere.
+        if (save_master != NULL && realpath(argv[optind - 1], masterdir) == NULL) {
+            perror(argv[optind - 1]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc)
+        return;
 
     /* Now the same for evaldir */
-    optind++;
-    n = strlen(argv[optind]);
+    size_t n = strlen(argv[optind]);
     if (n >= sizeof evaldir) {
         fprintf(stderr, "error: path too long\n");
         exit(EXIT_FAILURE);
@@ -220,56 +1402,40 @@ static void parse_command_line(int argc, char *argv[])
 
     memcpy(evaldir, argv[optind], n);
 
-    /* Are they directories though? Check */
-    if (!isdirectory(masterdir) || !isdirectory(evaldir)) {
+    /* Is it a directory though? Check */
+    if (!isdirectory(evaldir)) {
         show_usage();
         exit(EXIT_FAILURE);
     }
+
+    if (stat(evaldir, &evalstat) == -1) {
+        perror(evaldir);
+        exit(EXIT_FAILURE);
+    }
 }
 
 // is current object, file or otherwise, part of eval-dir? Hmm, hard to tell,
 // given the risk of duplicate names. foo/bar/baz.c vs /usr/local/src/foo/bar/baz.c
 // is troublesome if eval-dir is just bar and master-dir is /. What do? We have to
 // manage this in case eval-dir is a sub-dir of master-dir.
-static int is_part_of_eval(const char *s)
+//
+// Comparing paths is fragile, so we compare the directories' device and
+// inode numbers instead, and skip eval-dir's subtree when we get there.
+static int is_eval_dir(const struct stat *sb)
 {
-    static char *evaldup;
-    static size_t evallen, dupsize;
-
-    // Get a copy of eval-dir and add slashes so strstr() won't be confused.
-    if (evaldup == NULL) {
-        evallen = strlen(evaldir);
-        dupsize = evallen + 3;
-        if ((evaldup = malloc(dupsize)) == NULL) {
-            fprintf(stderr, "error: out of memory\n");
-            exit(EXIT_FAILURE);
-        }
-
-        // What about leading slashes? bar/ != foobar/, right? I guess we 
-        // need one. May create problems for corner cases. Let's try.
-        if (evaldir[0] == '/')
-            evaldup[0] = '\0'; // No need for slash, we'll get it from evaldir
-        else
-            strcpy(evaldup, "/"); // leading slash
-
-        strcat(evaldup, evaldir);
-
-        // Append slash if needed
-        if (evaldir[evallen - 1] != '/')
-            strcat(evaldup, "/");
-    }
-
-    // Right, so now we have something to search for. 
-    return strstr(s, evaldup) != NULL;
+    return sb->st_dev == evalstat.st_dev && sb->st_ino == evalstat.st_ino;
 }
 
-int master_callback(const char *fpath, const struct stat *sb, int typeflag __attribute__((unused)), struct FTW *ftwbuf __attribute__((unused)))
+int master_callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
     static unsigned long nfiles;
 
-    // Ignore paths which include eval-dir's path. 
-    if (is_part_of_eval(fpath))
-        return 0;
+    // Ignore eval-dir, if it's in master-dir.
+    if (typeflag == FTW_D && is_eval_dir(sb))
+        return FTW_SKIP_SUBTREE;
+
+    if (relative && typeflag == FTW_D)
+        add_master_path(fpath + ftwbuf->base, sb, typeflag, ftwbuf->level);
 
     // Ignore anything but regular files
     if (!S_ISREG(sb->st_mode)) {
@@ -278,39 +1444,41 @@ int master_callback(const char *fpath, const struct stat *sb, int typeflag __att
         return 0;
     }
 
-    if (sb->st_size == 0) {
+    if (sb->st_size == 0 && !quick) {
         if (debug)
             fprintf(stderr, "Skipping empty file %s\n", fpath);
         return 0;
     }
 
-    // So far so good. Store path somewhere suitable for qsort().
-    add_entry(fpath);
+    // So far so good. We only need the name, or the size and the path.
+    // A snapshot gets both.
+    if (relative)
+        add_master_path(fpath + ftwbuf->base, sb, typeflag, ftwbuf->level);
+    else if (content || save_master != NULL)
+        add_master_file(fpath, sb->st_size);
+    if (!content || save_master != NULL)
+        add_name(fpath + ftwbuf->base);
     if (verbose)
         fprintf(stderr, "\r%lu", ++nfiles);
 
     return 0;
 }
 
-static int eval_cmp(const void *v1, const void *v2)
+static int in_master_dir(const char *name)
 {
-    const char *key = v1;
-    const struct entry *p = v2;
+    assert(name != NULL);
 
-    return strcmp(p->fname, key) == 0;
+    return nslots > 0 && find_slot(name, hash_name(name))->offset != 0;
 }
 
-static int in_master_dir(const char *fpath)
+// Check if file is in master, or if it's unique
+int eval_callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
-    assert(fpath != NULL);
-    assert(strlen(fpath) > 0);
-
-    return bsearch(fpath, entries, sizeof *entries, nentries_used, eval_cmp) != NULL;
-}
+    if (relative && typeflag == FTW_D) {
+        find_master_file(fpath + ftwbuf->base, typeflag, ftwbuf->level);
+        return 0;
+    }
 
-// Check if file is in master, or if 
-int eval_callback(const char *fpath, const struct stat *sb, int typeflag __attribute__((unused)), struct FTW *ftwbuf __attribute__((unused)))
-{
     // Ignore anything but regular files
     if (!S_ISREG(sb->st_mode)) {
         if (debug)
@@ -318,8 +1486,21 @@ int eval_callback(const char *fpath, const struct stat *sb, int typeflag __attri
         return 0;
     }
 
+    // Empty files aren't in master's table, so they'd all be unique.
+    if (sb->st_size == 0 && !quick) {
+        if (debug)
+            fprintf(stderr, "Skipping empty file %s\n", fpath);
+        return 0;
+    }
+
     // Is file found in master-dir? If not, we have a unique file
-    if (in_master_dir(fpath))
+    if (quick)
+        quick_check(fpath, sb, find_master_file(fpath + ftwbuf->base, typeflag, ftwbuf->level));
+    else if (relative) {
+        if (find_master_file(fpath + ftwbuf->base, typeflag, ftwbuf->level) == NO_NODE)
+            puts(fpath);
+    }
+    else if (content ? !content_in_master(fpath, sb->st_size) : !in_master_dir(fpath + ftwbuf->base))
         puts(fpath);
 
     return 0;
@@ -335,8 +1516,12 @@ static void traverse_master(void)
         fprintf(stderr, "Checking directory:%s\n", masterdir);
 
     nftw(masterdir, master_callback, nopenfd, ftw_flags);
-    if (verbose)
-        fprintf(stderr, "\n");
+    if (verbose && content)
+        fprintf(stderr, "\n%zu files with %zu distinct sizes\n", nmfiles, nsizes);
+    else if (verbose && relative)
+        fprintf(stderr, "\n%zu paths with %zu distinct names\n", nnodes, nnames);
+    else if (verbose)
+        fprintf(stderr, "\n%zu distinct names in %zu slots\n", nnames, nslots);
 }
 
 static void traverse_eval(void)
@@ -353,18 +1538,251 @@ static void traverse_eval(void)
         fprintf(stderr, "\n");
 }
 
-static int cmp(const void *v1, const void *v2)
+// With -b, master's keys go into a Bloom filter instead of the tables
+// above, so memory use is set by the false positive rate we accept,
+// about 1.44 * log2(1/rate) bits per file, and not by the names. We
+// need the number of files to size the filter. If -N doesn't give it,
+// we walk master once to count them.
+//
+// Eval files which aren't in the filter are unique, and printed at
+// once. The others may be in master, so we remember them, and walk
+// master again to check. That walk only looks up keys, so it's cheap.
+// Eval files found to be unique then are printed last.
+static struct {
+    uint64_t *bits;
+    uint64_t nbits;
+    unsigned nhashes;
+} bloom;
+
+static struct {
+    unsigned long long masterfiles, maybe, unique;
+} bloomcounts;
+
+// The files we're not sure of. path is the offset of the file's path
+// in paths, and name the offset of its key in the name arena. The slots
+// move while we add keys, so we find the key's slot when we're done.
+struct maybe {
+    size_t path;
+    uint32_t name;
+    size_t slot;
+};
+
+static struct maybe *maybes;
+static size_t nmaybes, maybes_max;
+static unsigned char *confirmed; // One byte per name slot
+
+// The key is the name, or with -r, the path relative to the root.
+static const char *bloom_key(const char *fpath, const struct FTW *ftwbuf, size_t rootlen)
+{
+    if (!relative)
+        return fpath + ftwbuf->base;
+
+    fpath += rootlen;
+    while (*fpath == '/')
+        fpath++;
+
+    return fpath;
+}
+
+// 64 bit FNV-1a, split in two for double hashing.
+static void bloom_hash(const char *key, uint64_t *h1, uint64_t *h2)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while (*key != '\0') {
+        h ^= (unsigned char)*key++;
+        h *= 0x100000001b3ULL;
+    }
+
+    *h1 = h;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    *h2 = h | 1;
+}
+
+static void bloom_add(const char *key)
+{
+    uint64_t h1, h2, bit;
+    unsigned i;
+
+    bloom_hash(key, &h1, &h2);
+    for (i = 0; i < bloom.nhashes; i++) {
+        bit = (h1 + i * h2) % bloom.nbits;
+        bloom.bits[bit / 64] |= UINT64_C(1) << (bit % 64);
+    }
+}
+
+static int bloom_has(const char *key)
+{
+    uint64_t h1, h2, bit;
+    unsigned i;
+
+    bloom_hash(key, &h1, &h2);
+    for (i = 0; i < bloom.nhashes; i++) {
+        bit = (h1 + i * h2) % bloom.nbits;
+        if ((bloom.bits[bit / 64] & (UINT64_C(1) << (bit % 64))) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void bloom_init(unsigned long long n)
+{
+    double bits_per_key = -log(bloom_rate) / (M_LN2 * M_LN2);
+
+    if (n == 0)
+        n = 1;
+
+    bloom.nbits = ((uint64_t)ceil(bits_per_key * n) + 63) / 64 * 64;
+    bloom.nhashes = (unsigned)(bits_per_key * M_LN2 + 0.5);
+    if (bloom.nhashes < 1)
+        bloom.nhashes = 1;
+    else if (bloom.nhashes > 30)
+        bloom.nhashes = 30;
+
+    if ((bloom.bits = calloc(bloom.nbits / 64, sizeof *bloom.bits)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (verbose)
+        fprintf(stderr, "Bloom filter for %llu files: %llu bytes, %u hashes\n",
+            n, (unsigned long long)bloom.nbits / 8, bloom.nhashes);
+}
+
+static int bloom_wanted(const char *fpath, const struct stat *sb, int typeflag)
+{
+    if (typeflag == FTW_D && is_eval_dir(sb))
+        return FTW_SKIP_SUBTREE;
+
+    if (!S_ISREG(sb->st_mode) || sb->st_size == 0) {
+        if (debug)
+            fprintf(stderr, "Skipping %s. Not a regular file, or empty.\n", fpath);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int bloom_count_callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf __attribute__((unused)))
+{
+    int rc = bloom_wanted(fpath, sb, typeflag);
+
+    if (rc == 1)
+        bloomcounts.masterfiles++;
+
+    return rc == 1 ? 0 : rc;
+}
+
+static int bloom_master_callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    int rc = bloom_wanted(fpath, sb, typeflag);
+
+    if (rc == 1)
+        bloom_add(bloom_key(fpath, ftwbuf, strlen(masterdir)));
+
+    return rc == 1 ? 0 : rc;
+}
+
+static int bloom_eval_callback(const char *fpath, const struct stat *sb, int typeflag __attribute__((unused)), struct FTW *ftwbuf)
+{
+    const char *key;
+    struct maybe *tmp;
+
+    if (!S_ISREG(sb->st_mode) || sb->st_size == 0)
+        return 0;
+
+    key = bloom_key(fpath, ftwbuf, strlen(evaldir));
+    if (!bloom_has(key)) {
+        bloomcounts.unique++;
+        puts(fpath);
+        return 0;
+    }
+
+    if (nmaybes == maybes_max) {
+        maybes_max = maybes_max == 0 ? 64 * 1024 : maybes_max * 2;
+        if ((tmp = realloc(maybes, maybes_max * sizeof *maybes)) == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+
+        maybes = tmp;
+    }
+
+    maybes[nmaybes].name = add_name(key);
+    maybes[nmaybes].path = add_path(fpath);
+    nmaybes++;
+    return 0;
+}
+
+static int bloom_verify_callback(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
 {
-    const struct entry *p1 = v1, *p2 = v2;
-    return strcmp(p1->fname, p2->fname);
+    const char *key;
+    struct slot *slot;
+    int rc = bloom_wanted(fpath, sb, typeflag);
+
+    if (rc != 1)
+        return rc;
+
+    key = bloom_key(fpath, ftwbuf, strlen(masterdir));
+    if ((slot = find_slot(key, hash_name(key)))->offset != 0)
+        confirmed[slot - slots] = 1;
+
+    return 0;
 }
 
-static void sort_master_files(void)
+static void bloom_compare(void)
 {
+    int nopenfd = 12;
+    size_t i;
+
+    if (bloom_count == 0) {
+        if (verbose)
+            fprintf(stderr, "Counting files in %s\n", masterdir);
+        nftw(masterdir, bloom_count_callback, nopenfd, ftw_flags);
+        bloom_count = bloomcounts.masterfiles;
+    }
+
+    bloom_init(bloom_count);
+
+    if (verbose)
+        fprintf(stderr, "Checking directory:%s\n", masterdir);
+    nftw(masterdir, bloom_master_callback, nopenfd, ftw_flags);
+
+    if (verbose)
+        fprintf(stderr, "Checking directory:%s\n", evaldir);
+    nftw(evaldir, bloom_eval_callback, nopenfd, ftw_flags);
+
+    // The filter isn't needed anymore.
+    free(bloom.bits);
+    bloom.bits = NULL;
+    bloomcounts.maybe = nmaybes;
+    if (nmaybes == 0)
+        return;
+
+    for (i = 0; i < nmaybes; i++) {
+        const char *key = &arena[maybes[i].name];
+
+        maybes[i].slot = find_slot(key, hash_name(key)) - slots;
+    }
+
+    if ((confirmed = calloc(nslots, 1)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (verbose)
-        fprintf(stderr, "Sorting %zu found files\n", nentries_used);
+        fprintf(stderr, "Checking %zu files again in %s\n", nmaybes, masterdir);
+    nftw(masterdir, bloom_verify_callback, nopenfd, ftw_flags);
 
-    qsort(entries, nentries_used, sizeof *entries, cmp);
+    for (i = 0; i < nmaybes; i++) {
+        if (!confirmed[maybes[i].slot]) {
+            bloomcounts.unique++;
+            puts(&paths[maybes[i].path]);
+        }
+    }
 }
 
 int main(int argc, char *argv[])
@@ -373,9 +1791,41 @@ int main(int argc, char *argv[])
     // We can't do full expansion, can we? Hmm...
 
     parse_command_line(argc, argv);
-    traverse_master();
-    sort_master_files();
-    traverse_eval();
+
+    if (nway) {
+        compare_trees();
+        if (verbose && content)
+            fprintf(stderr, "Hashed %lu files, %llu bytes\n", counts.eval_hashed, counts.bytes_hashed);
+        return 0;
+    }
+
+    if (bloom_rate > 0) {
+        bloom_compare();
+        if (verbose)
+            fprintf(stderr, "%llu unique files, %llu checked twice\n", bloomcounts.unique, bloomcounts.maybe);
+        return 0;
+    }
+
+    if (master_index != NULL)
+        load_master_index(master_index);
+    else
+        traverse_master();
+
+    if (evaldir[0] != '\0')
+        traverse_eval();
+
+    // We save last, so digests computed for eval are saved too.
+    if (save_master != NULL)
+        write_master_index(save_master);
+
+    if (verbose && quick)
+        fprintf(stderr, "%llu missing, %llu same, %llu changed. Compared %llu files, %llu bytes\n",
+            quickcounts.missing, quickcounts.same, quickcounts.changed,
+            quickcounts.compared, quickcounts.bytes_read);
+
+    if (verbose && content)
+        fprintf(stderr, "Hashed %lu eval files and %lu of %zu master files, %llu bytes\n",
+            counts.eval_hashed, counts.master_hashed, nmfiles, counts.bytes_hashed);
 
     return 0;
 }